@@ -1,7 +1,34 @@
 #include "environment.h"
 #include "object.h"
 
+#include <vector>
+
 namespace Lisp {
+  static std::vector<Environment*> frame_pool;
+  static std::vector<Environment*> frames; // every frame, pooled or in use
+
+  Environment* Environment::new_frame() {
+    if(frame_pool.empty()) {
+      frames.push_back(new Environment(true));
+      return frames.back();
+    }
+
+    auto env = frame_pool.back();
+    frame_pool.pop_back();
+    // a collection may have marked it through a task's stale env
+    env->mark_flag = false;
+    return env;
+  }
+
+  void Environment::clear_frame_pool() {
+    for(auto env : frames) delete env;
+    frames.clear();
+    frame_pool.clear();
+  }
+
+  void Environment::unmark_frames() {
+    for(auto env : frames) env->mark_flag = false;
+  }
   bool Environment::exists_local(key &name) {
     return locals.find(name) != locals.end();
   }
@@ -9,23 +36,51 @@ namespace Lisp {
   Environment* Environment::get_env_by_name(key &name) {
     if(exists_local(name)) return this;
     else {
-      Environment* ret;
-      if(lexical_parent && (ret = lexical_parent->get_env_by_name(name))) return ret;
-      if(parent && (ret = parent->get_env_by_name(name))) return ret;
+      // a function's frame sees its closure, not its caller's frames
+      if(lexical_parent) return lexical_parent->get_env_by_name(name);
+      if(parent) return parent->get_env_by_name(name);
       return nullptr;
     }
   }
 
   void Environment::set(key &name, Object* val) {
     auto env = get_env_by_name(name);
-    if(env) env->locals[name] = val;
-    else locals[name] = val;
+    if(!env) {
+      locals[name] = val;
+      if(late) late->share(name, this);
+      return;
+    }
+
+    auto &slot = env->locals[name];
+    if(slot->type == TYPE_BOX) ((Box*)slot)->value = val;
+    else slot = val;
+  }
+
+  void Environment::bind(key &name, Object* val) {
+    locals[name] = val;
   }
 
   Object* Environment::get(key &name) {
     auto env = get_env_by_name(name);
-    if(env) return env->locals[name];
-    return nullptr;
+    if(!env) return nullptr;
+
+    auto val = env->locals[name];
+    return val->type == TYPE_BOX ? ((Box*)val)->value : val;
+  }
+
+  void Environment::share(key &name, Environment *owner) {
+    auto &slot = owner->locals[name];
+    if(slot->type != TYPE_BOX) slot = new Box(slot);
+    locals[name] = slot;
+  }
+
+  Environment* Environment::late_bindings(Environment *global) {
+    if(!late) {
+      late = new Environment();
+      bool outermost = lexical_parent || !parent || !parent->pooled;
+      late->parent = outermost ? global : parent->late_bindings(global);
+    }
+    return late;
   }
 
   Environment* Environment::down_env(Environment *new_env) {
@@ -36,7 +91,14 @@ namespace Lisp {
 
   Environment* Environment::up_env() {
     auto parent_env = parent;
-    parent_env->child = nullptr;
+    if(parent_env->child == this) parent_env->child = nullptr;
+
+    if(pooled) {
+      locals.clear();
+      parent = child = lexical_parent = late = nullptr;
+      mark_flag = false;
+      frame_pool.push_back(this);
+    }
     return parent_env;
   }
 
@@ -44,13 +106,17 @@ namespace Lisp {
     lexical_parent = alexical_parent;
   }
 
-  void Environment::mark() {
-    if(mark_flag) return;
-    GCObject::mark();
+  void Environment::set_parent(Environment *aparent) {
+    parent = aparent;
+  }
 
+  void Environment::mark_children(Marker &marker) {
     for(auto& kv : locals) {
-      kv.second->mark();
+      marker.mark(kv.second);
     }
-    if(child) child->mark();
+    if(child) marker.mark(child);
+    if(parent) marker.mark(parent);
+    if(lexical_parent) marker.mark(lexical_parent);
+    if(late) marker.mark(late);
   }
 }
@@ -15,22 +15,65 @@ namespace Lisp {
 
     Environment *parent, *child;
     Environment *lexical_parent;
+    // see late_bindings
+    Environment *late;
+
+    // true while this frame belongs to the frame pool rather than the gc
+    bool pooled;
 
     bool exists_local(key &name);
 
-    Environment* get_env_by_name(key &name);
+    explicit Environment(bool apooled)
+      : GCObject(TYPE_ENVIRONMENT, !apooled), parent(nullptr), child(nullptr), lexical_parent(nullptr), late(nullptr),
+        pooled(apooled) {}
   public:
 
-    Environment() : parent(nullptr), child(nullptr), lexical_parent(nullptr) {}
+    Environment() : GCObject(TYPE_ENVIRONMENT), parent(nullptr), child(nullptr), lexical_parent(nullptr), late(nullptr),
+      pooled(false) {}
+
+    // a frame for let, for and function calls. closures copy the bindings they
+    // use instead of keeping frames, so a frame is reused by a later new_frame
+    // as soon as up_env pops it.
+    static Environment* new_frame();
+    static void clear_frame_pool();
+
+    // the environment that binds name, or nullptr
+    Environment* get_env_by_name(key &name);
+
+    // resets mark flags of the frames, which the sweep doesn't see
+    static void unmark_frames();
+
+    // the frame evaluation went down to from this one, if it is still there
+    Environment* child_env() { return child; }
+
+    const std::map<key, Object*>& bindings() { return locals; }
 
+    // binds name in the environment that binds it, or here if none does
     void set(key &name, Object* val);
+    // binds name here, shadowing any outer binding
+    void bind(key &name, Object* val);
     Object* get(key &name);
 
+    // binds name here to the box of name's binding in owner, boxing that
+    // binding first if needed; see Box
+    void share(key &name, Environment *owner);
+
+    // an environment every name bound in this frame from now on is shared to,
+    // so closures made here can see locals assigned after they were made, as
+    // a local recursive function sees its own name. it falls through to the
+    // late bindings of the enclosing frames up to the function's frame, then
+    // to global
+    Environment* late_bindings(Environment *global);
+
     Environment* down_env(Environment *new_env);
     Environment* up_env();
 
+    // lookups go to alexical_parent instead of the parent
     void set_lexical_parent(Environment *alexical_parent);
+    // lookups fall through to aparent, but aparent's child stays as it is; the
+    // bottom frame of a task, whose frames aren't on the main chain
+    void set_parent(Environment *aparent);
 
-    void mark();
+    void mark_children(Marker &marker);
   };
 }
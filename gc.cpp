@@ -1,6 +1,374 @@
 #include "gc.h"
+#include "object.h"
+#include "environment.h"
+#include "memo.h"
+#include "task.h"
+#include "token.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 namespace Lisp {
-  class GCObject;
-  std::list<GCObject*> objects;
+  std::unordered_set<GCObject*> weak_objects;
+
+  // objects live in pages of PAGE_SIZE slots; sweeping works a page at a time
+  static const size_t PAGE_SIZE = 4096;
+  // heaps smaller than this are marked on the calling thread alone
+  static const size_t PARALLEL_MARK_THRESHOLD = 64 * 1024;
+  static const size_t MAX_MARK_THREADS = 8;
+
+  // the value of the environment variable name if it is set to a number, so
+  // tests can make small heaps be marked in parallel
+  static size_t env_size(const char *name, size_t default_value) {
+    const char *value = std::getenv(name);
+    if(!value || !*value) return default_value;
+    char *end;
+    auto n = std::strtoul(value, &end, 10);
+    return *end ? default_value : n;
+  }
+
+  struct Page {
+    std::vector<GCObject*> slots;
+
+    Page() { slots.reserve(PAGE_SIZE); }
+
+    bool full() { return slots.size() >= PAGE_SIZE; }
+  };
+
+  static std::vector<Page*> pages;      // every page
+  static std::vector<Page*> unswept;    // marked but not swept yet
+  static std::vector<Page*> open_pages; // swept, with room for more objects
+  static Page *current_page = nullptr;
+  static size_t count = 0;
+  static size_t allocated = 0;
+
+  const char* type_name(ObjectType type) {
+    switch(type) {
+      case TYPE_STRING:      return "String";
+      case TYPE_INTEGER:     return "Integer";
+      case TYPE_SYMBOL:      return "Symbol";
+      case TYPE_NIL:         return "Nil";
+      case TYPE_T:           return "T";
+      case TYPE_CONS:        return "Cons";
+      case TYPE_LAMBDA:      return "Lambda";
+      case TYPE_MACRO:       return "Macro";
+      case TYPE_PROMISE:     return "Promise";
+      case TYPE_LINE_READER: return "LineReader";
+      case TYPE_MEMO:        return "Memo";
+      case TYPE_TASK:        return "Task";
+      case TYPE_CHANNEL:     return "Channel";
+      case TYPE_BOX:         return "Box";
+      case TYPE_ENVIRONMENT: return "Environment";
+      case TYPE_CONS_TABLE:  return "ConsTable";
+      case TYPE_TOKEN:       return "Token";
+    }
+    return "?";
+  }
+
+  static void sweep_page(Page *page) {
+    auto &slots = page->slots;
+    size_t live = 0;
+    for(size_t i = 0 ; i < slots.size() ; i++) {
+      auto obj = slots[i];
+      if(obj->mark_flag) {
+        obj->mark_flag = false;
+        slots[live++] = obj;
+      }
+      else {
+        destroy(obj);
+        count--;
+      }
+    }
+    slots.resize(live);
+  }
+
+  static Page* next_page() {
+    while(!open_pages.empty()) {
+      auto page = open_pages.back();
+      open_pages.pop_back();
+      if(!page->full()) return page;
+    }
+    while(!unswept.empty()) {
+      auto page = unswept.back();
+      unswept.pop_back();
+      sweep_page(page);
+      if(!page->full()) return page;
+    }
+
+    pages.push_back(new Page());
+    return pages.back();
+  }
+
+  void register_object(GCObject *obj) {
+    if(!current_page || current_page->full()) current_page = next_page();
+    current_page->slots.push_back(obj);
+    count++;
+    allocated++;
+  }
+
+  void sweep_lazily() {
+    unswept = pages;
+    open_pages.clear();
+    current_page = nullptr;
+  }
+
+  void finish_sweep() {
+    while(!unswept.empty()) {
+      auto page = unswept.back();
+      unswept.pop_back();
+      sweep_page(page);
+      if(!page->full()) open_pages.push_back(page);
+    }
+  }
+
+  size_t object_count() {
+    finish_sweep();
+    return count;
+  }
+
+  size_t allocation_count() {
+    return allocated;
+  }
+
+  class MarkState {
+  public:
+    // a worker pushes and pops at the back of its own deque; thieves take from the front
+    struct Deque {
+      std::mutex lock;
+      std::deque<GCObject*> items;
+      std::atomic<size_t> size;
+
+      Deque() : size(0) {}
+    };
+
+    std::vector<Deque> deques;
+    std::atomic<size_t> idle;
+    size_t threads;
+
+    // marking on one thread needs no locks or atomic exchanges; it uses this stack
+    std::vector<GCObject*> stack;
+
+    MarkState(size_t athreads) : deques(athreads), idle(0), threads(athreads) {}
+
+    void push(size_t id, GCObject *obj) {
+      auto &dq = deques[id];
+      std::lock_guard<std::mutex> guard(dq.lock);
+      dq.items.push_back(obj);
+      dq.size.store(dq.items.size(), std::memory_order_relaxed);
+    }
+
+    bool pop(size_t id, GCObject *&obj) {
+      auto &dq = deques[id];
+      std::lock_guard<std::mutex> guard(dq.lock);
+      if(dq.items.empty()) return false;
+      obj = dq.items.back();
+      dq.items.pop_back();
+      dq.size.store(dq.items.size(), std::memory_order_relaxed);
+      return true;
+    }
+
+    // moves half of some other worker's deque into id's
+    bool steal(size_t id) {
+      for(size_t i = 1 ; i < threads ; i++) {
+        auto &victim = deques[(id + i) % threads];
+        if(victim.size.load(std::memory_order_relaxed) == 0) continue;
+
+        std::vector<GCObject*> loot;
+        {
+          std::lock_guard<std::mutex> guard(victim.lock);
+          size_t n = (victim.items.size() + 1) / 2;
+          loot.assign(victim.items.begin(), victim.items.begin() + n);
+          victim.items.erase(victim.items.begin(), victim.items.begin() + n);
+          victim.size.store(victim.items.size(), std::memory_order_relaxed);
+        }
+        if(loot.empty()) continue;
+
+        auto &own = deques[id];
+        std::lock_guard<std::mutex> guard(own.lock);
+        own.items.insert(own.items.end(), loot.begin(), loot.end());
+        own.size.store(own.items.size(), std::memory_order_relaxed);
+        return true;
+      }
+      return false;
+    }
+
+    bool has_work() {
+      for(auto &dq : deques) {
+        if(dq.size.load(std::memory_order_relaxed) > 0) return true;
+      }
+      return false;
+    }
+  };
+
+  void Marker::mark(GCObject *obj) {
+    if(!obj) return;
+
+    if(edges) {
+      edges->push_back(obj);
+      return;
+    }
+
+    if(state->threads == 1) {
+      if(obj->mark_flag) return;
+      obj->mark_flag = true;
+      state->stack.push_back(obj);
+      return;
+    }
+
+    if(__atomic_load_n(&obj->mark_flag, __ATOMIC_RELAXED)) return;
+    if(__atomic_exchange_n(&obj->mark_flag, true, __ATOMIC_ACQ_REL)) return; // another thread got it first
+    state->push(id, obj);
+  }
+
+  static void mark_children(GCObject *obj, Marker &marker) {
+    switch(obj->type) {
+      case TYPE_CONS:        ((Cons*)obj)->mark_children(marker); break;
+      case TYPE_LAMBDA:      ((Lambda*)obj)->mark_children(marker); break;
+      case TYPE_MACRO:       ((Macro*)obj)->mark_children(marker); break;
+      case TYPE_PROMISE:     ((Promise*)obj)->mark_children(marker); break;
+      case TYPE_MEMO:        ((Memo*)obj)->mark_children(marker); break;
+      case TYPE_TASK:        ((Task*)obj)->mark_children(marker); break;
+      case TYPE_CHANNEL:     ((Channel*)obj)->mark_children(marker); break;
+      case TYPE_BOX:         marker.mark(((Box*)obj)->value); break;
+      case TYPE_ENVIRONMENT: ((Environment*)obj)->mark_children(marker); break;
+      default: break;
+    }
+  }
+
+  void children_of(GCObject *obj, std::vector<GCObject*> &children) {
+    Marker marker(&children);
+    mark_children(obj, marker);
+  }
+
+  void Marker::run() {
+    if(state->threads == 1) {
+      auto &stack = state->stack;
+      while(!stack.empty()) {
+        auto obj = stack.back();
+        stack.pop_back();
+        mark_children(obj, *this);
+      }
+      return;
+    }
+
+    GCObject *obj;
+    while(true) {
+      while(state->pop(id, obj)) mark_children(obj, *this);
+
+      if(state->steal(id)) continue;
+
+      // out of work. only a worker with work pushes more, so once every worker
+      // is idle here, all the deques are empty for good
+      state->idle++;
+      while(true) {
+        if(state->idle.load() == state->threads) return;
+        if(state->has_work()) {
+          state->idle--;
+          break;
+        }
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  // appends the objects whose addresses are in range to found. any word that
+  // looks like one counts, so it may keep some garbage alive
+  __attribute__((no_sanitize_address))
+  static void scan_range(const char *begin, const char *end,
+                         const std::unordered_set<GCObject*> &objects, std::vector<GCObject*> &found) {
+    auto word = (GCObject* const*)(((uintptr_t)begin + sizeof(void*) - 1) & ~(uintptr_t)(sizeof(void*) - 1));
+    for(; (const char*)(word + 1) <= end ; word++) {
+      GCObject *candidate = *word;
+      if(objects.count(candidate)) found.push_back(candidate);
+    }
+  }
+
+  void mark_from(const std::vector<GCObject*> &roots, const MemoryRanges &ranges) {
+    if(ranges.empty()) {
+      mark_from(roots);
+      return;
+    }
+
+    finish_sweep();
+    std::unordered_set<GCObject*> objects;
+    for(auto page : pages) objects.insert(page->slots.begin(), page->slots.end());
+
+    std::vector<GCObject*> all_roots(roots);
+    for(auto &range : ranges) scan_range(range.first, range.second, objects, all_roots);
+    mark_from(all_roots);
+  }
+
+  void mark_from(const std::vector<GCObject*> &roots) {
+    // marks left on unswept pages are from the last collection
+    finish_sweep();
+
+    static const size_t threshold = env_size("LISP_GC_PARALLEL_THRESHOLD", PARALLEL_MARK_THRESHOLD);
+    static const size_t forced_threads = env_size("LISP_GC_THREADS", 0);
+
+    size_t threads = 1;
+    if(count >= threshold) {
+      threads = forced_threads ? forced_threads : std::thread::hardware_concurrency();
+      threads = std::max((size_t)1, std::min(MAX_MARK_THREADS, threads));
+    }
+
+    MarkState state(threads);
+    Marker marker(&state, 0);
+    for(auto root : roots) marker.mark(root);
+
+    std::vector<std::thread> workers;
+    for(size_t i = 1 ; i < threads ; i++) {
+      workers.emplace_back([&state, i]() {
+        Marker(&state, i).run();
+      });
+    }
+    marker.run();
+    for(auto &worker : workers) worker.join();
+  }
+
+  void GCObject::clear_weak() {
+    switch(type) {
+      case TYPE_MEMO:       ((Memo*)this)->clear_weak(); break;
+      case TYPE_CONS_TABLE: ((ConsTable*)this)->clear_weak(); break;
+      default: break;
+    }
+  }
+
+  void destroy(GCObject *obj) {
+    switch(obj->type) {
+      case TYPE_STRING:      delete (String*)obj; break;
+      case TYPE_INTEGER:     delete (Integer*)obj; break;
+      case TYPE_SYMBOL:      delete (Symbol*)obj; break;
+      case TYPE_NIL:         delete (Nil*)obj; break;
+      case TYPE_T:           delete (T*)obj; break;
+      case TYPE_CONS:        delete (Cons*)obj; break;
+      case TYPE_LAMBDA:      delete (Lambda*)obj; break;
+      case TYPE_MACRO:       delete (Macro*)obj; break;
+      case TYPE_PROMISE:     delete (Promise*)obj; break;
+      case TYPE_LINE_READER: delete (LineReader*)obj; break;
+      case TYPE_MEMO:        delete (Memo*)obj; break;
+      case TYPE_TASK:        delete (Task*)obj; break;
+      case TYPE_CHANNEL:     delete (Channel*)obj; break;
+      case TYPE_BOX:         delete (Box*)obj; break;
+      case TYPE_ENVIRONMENT: delete (Environment*)obj; break;
+      case TYPE_CONS_TABLE:  delete (ConsTable*)obj; break;
+      case TYPE_TOKEN:       delete (Token*)obj; break;
+    }
+  }
+
+  void destroy_all() {
+    for(auto page : pages) {
+      for(auto obj : page->slots) destroy(obj);
+      delete page;
+    }
+    pages.clear();
+    unswept.clear();
+    open_pages.clear();
+    current_page = nullptr;
+    count = 0;
+  }
 }
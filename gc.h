@@ -1,23 +1,111 @@
 #pragma once
 
-#include <list>
+#include <cstddef>
+#include <vector>
+#include <unordered_set>
+#include <utility>
 
 namespace Lisp {
   class GCObject;
-  extern std::list<GCObject*> objects;
+  // objects holding weak references; see clear_weak
+  extern std::unordered_set<GCObject*> weak_objects;
 
+  // the concrete class of a GCObject. dispatch is a switch on this rather than
+  // virtual calls, so objects carry no vtable pointer.
+  enum ObjectType : unsigned char {
+    TYPE_STRING,
+    TYPE_INTEGER,
+    TYPE_SYMBOL,
+    TYPE_NIL,
+    TYPE_T,
+    TYPE_CONS,
+    TYPE_LAMBDA,
+    TYPE_MACRO,
+    TYPE_PROMISE,
+    TYPE_LINE_READER,
+    TYPE_MEMO,
+    TYPE_TASK,
+    TYPE_CHANNEL,
+    TYPE_BOX,
+    TYPE_ENVIRONMENT,
+    TYPE_CONS_TABLE,
+    TYPE_TOKEN,
+  };
+
+  const int TYPE_COUNT = TYPE_TOKEN + 1;
+
+  const char* type_name(ObjectType type);
+
+  // adds obj to the heap's pages; see GCObject
+  void register_object(GCObject *obj);
+
+  // the whole header is the type tag and the mark bit
   class GCObject {
   public:
+    const ObjectType type;
+    // parallel marking sets this with atomic builtins; see Marker::mark
     bool mark_flag;
 
-    GCObject() {
-      objects.push_back(this);
+    explicit GCObject(ObjectType atype) : type(atype), mark_flag(false) {
+      register_object(this);
     }
 
-    virtual ~GCObject() {}
-
-    virtual void mark() {
-      mark_flag = true;
+    // an object the gc doesn't own unless managed
+    GCObject(ObjectType atype, bool managed) : type(atype), mark_flag(false) {
+      if(managed) register_object(this);
     }
+
+    // called on marked objects in weak_objects between mark and sweep; drops
+    // references to unmarked objects
+    void clear_weak();
+  };
+
+  class MarkState;
+
+  // handed to each class's mark_children(Marker&), which calls mark() on
+  // everything the object refers to
+  class Marker {
+    MarkState *state;
+    size_t id;
+    std::vector<GCObject*> *edges;
+
+  public:
+    Marker(MarkState *astate, size_t aid) : state(astate), id(aid), edges(nullptr) {}
+    // a marker that only appends the objects it is given to aedges; see children_of
+    explicit Marker(std::vector<GCObject*> *aedges) : state(nullptr), id(0), edges(aedges) {}
+
+    // sets obj's mark bit, and queues obj to have its children marked if it wasn't set
+    void mark(GCObject *obj);
+
+    void run();
   };
+
+  // marks everything reachable from roots. on large heaps this runs on several
+  // threads, each tracing from its own deque and stealing from the others'
+  // when that runs dry.
+  void mark_from(const std::vector<GCObject*> &roots);
+
+  typedef std::vector<std::pair<const char*, const char*>> MemoryRanges;
+  // marks from roots and from every object whose address is a word in one of
+  // ranges [begin, end). the native stacks of suspended tasks are scanned this
+  // way, since their frames hold objects no root reaches
+  void mark_from(const std::vector<GCObject*> &roots, const MemoryRanges &ranges);
+
+  // appends the objects obj refers to (what marking obj would mark) to children
+  void children_of(GCObject *obj, std::vector<GCObject*> &children);
+
+  // hands every page over to the lazy sweeper: unmarked objects on a page are
+  // deleted, and the page reused, when allocation next needs room. objects
+  // allocated meanwhile only go to swept pages.
+  void sweep_lazily();
+  void finish_sweep();
+
+  // the number of objects in the heap; finishes sweeping first so it's exact
+  size_t object_count();
+  // the number of objects allocated so far, freed or not
+  size_t allocation_count();
+
+  // deletes obj as its concrete class
+  void destroy(GCObject *obj);
+  void destroy_all();
 }
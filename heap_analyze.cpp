@@ -0,0 +1,279 @@
+// reads a heap dump written by (heap-dump "file") or --heap-dump-on-exit and
+// reports where the memory goes: totals per type, and the objects, globals
+// and roots that retain the most. an object's retained size is the size of
+// everything that would be freed with it, i.e. everything it dominates in the
+// object graph, starting from the roots.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+  const uint32_t HEAP_DUMP_VERSION = 1;
+  const uint32_t UNDEFINED = UINT32_MAX;
+
+  struct Node {
+    unsigned char type;
+    uint32_t size;
+    std::vector<uint32_t> edges;
+  };
+
+  struct Dump {
+    std::vector<std::string> type_names;
+    uint64_t heap_objects;
+    std::vector<Node> nodes;
+    std::vector<std::pair<std::string, uint32_t>> roots, names;
+  };
+
+  class Reader {
+    std::string buf;
+    size_t pos;
+
+  public:
+    Reader(std::string abuf) : buf(std::move(abuf)), pos(0) {}
+
+    uint32_t u8() {
+      need(1);
+      return (unsigned char)buf[pos++];
+    }
+
+    uint32_t u32() {
+      need(4);
+      uint32_t n = 0;
+      for(int i = 0 ; i < 4 ; i++) n = (n << 8) | (unsigned char)buf[pos++];
+      return n;
+    }
+
+    uint64_t u64() {
+      uint64_t hi = u32();
+      return (hi << 32) | u32();
+    }
+
+    std::string str() {
+      auto len = u32();
+      need(len);
+      auto ret = buf.substr(pos, len);
+      pos += len;
+      return ret;
+    }
+
+    std::vector<std::pair<std::string, uint32_t>> labels(size_t node_count) {
+      std::vector<std::pair<std::string, uint32_t>> ret(u32());
+      for(auto &label : ret) {
+        label.first  = str();
+        label.second = u32();
+        if(label.second >= node_count) throw std::runtime_error("broken heap dump: bad id");
+      }
+      return ret;
+    }
+
+    void need(size_t n) {
+      if(buf.size() - pos < n) throw std::runtime_error("broken heap dump: unexpected end");
+    }
+  };
+
+  Dump read_dump(const std::string &path) {
+    std::ifstream ifs(path, std::ios::binary);
+    if(ifs.fail()) throw std::runtime_error("can't open " + path);
+    Reader reader(std::string((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>()));
+
+    std::string magic;
+    for(int i = 0 ; i < 4 ; i++) magic += (char)reader.u8();
+    if(magic != "SLHD") throw std::runtime_error(path + " is not a heap dump");
+    if(reader.u32() != HEAP_DUMP_VERSION) throw std::runtime_error("unsupported heap dump version");
+
+    Dump dump;
+    dump.type_names.resize(reader.u32());
+    for(auto &name : dump.type_names) name = reader.str();
+    dump.heap_objects = reader.u64();
+
+    dump.nodes.resize(reader.u32());
+    for(auto &node : dump.nodes) {
+      node.type = reader.u8();
+      node.size = reader.u32();
+      node.edges.resize(reader.u32());
+      for(auto &edge : node.edges) {
+        edge = reader.u32();
+        if(edge >= dump.nodes.size()) throw std::runtime_error("broken heap dump: bad id");
+      }
+    }
+
+    dump.roots = reader.labels(dump.nodes.size());
+    dump.names = reader.labels(dump.nodes.size());
+    return dump;
+  }
+
+  // immediate dominators, by Cooper, Harvey and Kennedy's iterative algorithm.
+  // node `root` is a virtual root with an edge to every root of the dump.
+  // unreachable nodes keep UNDEFINED.
+  std::vector<uint32_t> dominators(const Dump &dump, std::vector<uint32_t> &postorder) {
+    uint32_t n = dump.nodes.size(), root = n;
+
+    auto successors = [&](uint32_t v) -> std::vector<uint32_t> {
+      if(v != root) return dump.nodes[v].edges;
+      std::vector<uint32_t> ret;
+      for(auto &r : dump.roots) ret.push_back(r.second);
+      return ret;
+    };
+
+    // depth first, without recursion: a dump may hold a million-long list
+    std::vector<uint32_t> order(n + 1, UNDEFINED); // postorder number
+    std::vector<uint32_t> by_order;
+    std::vector<std::vector<uint32_t>> preds(n + 1);
+    {
+      std::vector<bool> seen(n + 1, false);
+      std::vector<std::pair<uint32_t, std::vector<uint32_t>>> stack;
+      seen[root] = true;
+      stack.push_back(std::make_pair(root, successors(root)));
+      while(!stack.empty()) {
+        auto &top = stack.back();
+        if(top.second.empty()) {
+          order[top.first] = by_order.size();
+          by_order.push_back(top.first);
+          stack.pop_back();
+          continue;
+        }
+        auto w = top.second.back();
+        top.second.pop_back();
+        preds[w].push_back(top.first);
+        if(!seen[w]) {
+          seen[w] = true;
+          stack.push_back(std::make_pair(w, successors(w)));
+        }
+      }
+    }
+
+    std::vector<uint32_t> idom(n + 1, UNDEFINED);
+    idom[root] = root;
+
+    auto intersect = [&](uint32_t a, uint32_t b) {
+      while(a != b) {
+        while(order[a] < order[b]) a = idom[a];
+        while(order[b] < order[a]) b = idom[b];
+      }
+      return a;
+    };
+
+    bool changed = true;
+    while(changed) {
+      changed = false;
+      // reverse postorder, skipping the root, which comes last in postorder
+      for(size_t i = by_order.size() - 1 ; i-- > 0 ; ) {
+        auto v = by_order[i];
+        uint32_t new_idom = UNDEFINED;
+        for(auto p : preds[v]) {
+          if(idom[p] == UNDEFINED) continue;
+          new_idom = new_idom == UNDEFINED ? p : intersect(p, new_idom);
+        }
+        if(idom[v] != new_idom) {
+          idom[v] = new_idom;
+          changed = true;
+        }
+      }
+    }
+
+    postorder.swap(by_order);
+    return idom;
+  }
+
+  std::string describe(const Dump &dump, uint32_t id, const std::map<uint32_t, std::string> &labels) {
+    auto type = dump.nodes[id].type;
+    std::string ret = type < dump.type_names.size() ? dump.type_names[type] : "?";
+    ret += " #" + std::to_string(id);
+    auto itr = labels.find(id);
+    if(itr != labels.end()) ret += " (" + itr->second + ")";
+    return ret;
+  }
+}
+
+int main(int argc, char **argv) {
+  using namespace std;
+
+  if(argc < 2 || argc > 3) {
+    cerr << "usage: " << argv[0] << " DUMP [TOP]" << endl;
+    return 1;
+  }
+  size_t top = argc == 3 ? max(atoi(argv[2]), 1) : 10;
+
+  Dump dump;
+  try {
+    dump = read_dump(argv[1]);
+  }
+  catch(exception &e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+
+  uint32_t n = dump.nodes.size(), root = n;
+  vector<uint32_t> postorder;
+  auto idom = dominators(dump, postorder);
+
+  // a node comes after everything it dominates in postorder
+  vector<uint64_t> retained(n + 1, 0);
+  for(auto v : postorder) {
+    if(v == root) continue;
+    retained[v] += dump.nodes[v].size;
+    retained[idom[v]] += retained[v];
+  }
+
+  map<uint32_t, string> labels;
+  for(auto &name : dump.names) labels[name.second] = name.first;
+  for(auto &r : dump.roots) labels[r.second] = r.first;
+
+  cout << "reachable: " << n << " objects, " << retained[root] << " bytes" << endl;
+  cout << "heap:      " << dump.heap_objects << " objects" << endl;
+
+  cout << endl << "by type:" << endl;
+  map<string, pair<uint64_t, uint64_t>> by_type; // count, bytes
+  for(auto &node : dump.nodes) {
+    auto &entry = by_type[node.type < dump.type_names.size() ? dump.type_names[node.type] : "?"];
+    entry.first++;
+    entry.second += node.size;
+  }
+  for(auto &kv : by_type) {
+    cout << "  " << left << setw(12) << kv.first << right << setw(10) << kv.second.first
+         << " objects " << setw(12) << kv.second.second << " bytes" << endl;
+  }
+
+  cout << endl << "retained by root:" << endl;
+  for(auto &r : dump.roots) {
+    // roots that share an object with another root don't dominate it
+    if(idom[r.second] != root) continue;
+    cout << "  " << left << setw(12) << r.first << right << setw(12) << retained[r.second] << " bytes" << endl;
+  }
+
+  // the globals: what each binding of root_env keeps alive. a value also
+  // reachable from another root isn't retained by root_env and counts as 0
+  vector<pair<uint64_t, string>> globals;
+  for(auto &name : dump.names) {
+    auto v = name.second;
+    uint64_t size = 0;
+    for(auto &r : dump.roots) {
+      if(r.first == "root_env" && idom[v] == r.second) size = retained[v];
+    }
+    globals.push_back(make_pair(size, name.first));
+  }
+  sort(globals.rbegin(), globals.rend());
+  cout << endl << "top retainers in root_env:" << endl;
+  for(size_t i = 0 ; i < globals.size() && i < top ; i++) {
+    cout << "  " << left << setw(24) << globals[i].second << right << setw(12) << globals[i].first << " bytes" << endl;
+  }
+
+  vector<uint32_t> ids;
+  for(uint32_t v = 0 ; v < n ; v++) ids.push_back(v);
+  sort(ids.begin(), ids.end(), [&](uint32_t a, uint32_t b) { return retained[a] > retained[b]; });
+  cout << endl << "top retainers:" << endl;
+  for(size_t i = 0 ; i < ids.size() && i < top ; i++) {
+    cout << "  " << left << setw(40) << describe(dump, ids[i], labels) << right << setw(12) << retained[ids[i]] << " bytes" << endl;
+  }
+
+  return 0;
+}
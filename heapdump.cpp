@@ -0,0 +1,167 @@
+#include "heapdump.h"
+#include "object.h"
+#include "environment.h"
+#include "memo.h"
+#include "task.h"
+#include "token.h"
+
+#include <cstdint>
+#include <fstream>
+#include <unordered_map>
+
+namespace Lisp {
+  // the format, with integers big-endian:
+  //   "SLHD", format version (u32),
+  //   type name count (u32), type names (u32 length + bytes each),
+  //   objects in the heap, reachable or not (u64),
+  //   object count (u32), objects,
+  //   root count (u32), roots, name count (u32), names
+  // an object is its type tag (u8), size (u32), edge count (u32) and the ids
+  // of the objects it refers to (u32 each); a root or a name is a label
+  // (u32 length + bytes) and an id. ids are the objects' indices in the file.
+  static const uint32_t HEAP_DUMP_VERSION = 1;
+
+  // an estimate: the object itself plus the heap memory only it owns
+  static size_t object_size(GCObject *obj) {
+    switch(obj->type) {
+      case TYPE_STRING:      return sizeof(String) + ((String*)obj)->length();
+      case TYPE_INTEGER:     return sizeof(Integer);
+      case TYPE_SYMBOL:      return sizeof(Symbol) + ((Symbol*)obj)->value.capacity();
+      case TYPE_NIL:         return sizeof(Nil);
+      case TYPE_T:           return sizeof(T);
+      case TYPE_CONS:        return sizeof(Cons);
+      case TYPE_LAMBDA:      return sizeof(Lambda);
+      case TYPE_MACRO:       return sizeof(Macro);
+      case TYPE_PROMISE:     return sizeof(Promise);
+      case TYPE_LINE_READER: return sizeof(LineReader);
+      case TYPE_MEMO:        return sizeof(Memo);
+      case TYPE_TASK:        return sizeof(Task);
+      case TYPE_BOX:         return sizeof(Box);
+      case TYPE_CHANNEL:     return sizeof(Channel) + ((Channel*)obj)->items.size() * sizeof(Object*);
+      case TYPE_CONS_TABLE:  return sizeof(ConsTable);
+      case TYPE_TOKEN:       return sizeof(Token) + ((Token*)obj)->value.capacity();
+      case TYPE_ENVIRONMENT: {
+        // a map node holds the pair and three links and a color
+        size_t size = sizeof(Environment);
+        for(auto &kv : ((Environment*)obj)->bindings()) {
+          size += sizeof(kv) + 4 * sizeof(void*) + kv.first.capacity();
+        }
+        return size;
+      }
+    }
+    return 0;
+  }
+
+  class HeapWriter {
+    std::ofstream ofs;
+    std::string buf;
+
+  public:
+    HeapWriter(const std::string &path) : ofs(path, std::ios::binary) {}
+
+    void put_byte(unsigned char c) {
+      buf += (char)c;
+      if(buf.size() >= 64 * 1024) flush();
+    }
+
+    void put_u32(uint32_t n) {
+      for(int shift = 24 ; shift >= 0 ; shift -= 8) put_byte(n >> shift);
+    }
+
+    void put_u64(uint64_t n) {
+      put_u32(n >> 32);
+      put_u32(n);
+    }
+
+    void put_string(const std::string &str) {
+      put_u32(str.size());
+      for(char c : str) put_byte(c);
+    }
+
+    // the offset the next byte will be written at
+    std::streampos tell() {
+      flush();
+      return ofs.tellp();
+    }
+
+    // overwrites the u32 at pos, which was written earlier
+    void patch_u32(std::streampos pos, uint32_t n) {
+      flush();
+      auto end = ofs.tellp();
+      ofs.seekp(pos);
+      put_u32(n);
+      flush();
+      ofs.seekp(end);
+    }
+
+    void flush() {
+      ofs.write(buf.data(), buf.size());
+      buf.clear();
+    }
+
+    bool good() { return ofs.good(); }
+  };
+
+  bool heap_dump(const std::string &path, const HeapLabels &roots, const HeapLabels &names) {
+    HeapWriter writer(path);
+    if(!writer.good()) return false;
+
+    for(char c : std::string("SLHD")) writer.put_byte(c);
+    writer.put_u32(HEAP_DUMP_VERSION);
+    writer.put_u32(TYPE_COUNT);
+    for(int type = 0 ; type < TYPE_COUNT ; type++) writer.put_string(type_name((ObjectType)type));
+    writer.put_u64(object_count());
+
+    // objects get ids as they are found, breadth first, and are written in id
+    // order. how many there are is known only at the end
+    std::unordered_map<GCObject*, uint32_t> ids;
+    std::vector<GCObject*> queue;
+    auto id_of = [&](GCObject *obj) {
+      auto itr = ids.find(obj);
+      if(itr != ids.end()) return itr->second;
+      uint32_t id = queue.size();
+      ids[obj] = id;
+      queue.push_back(obj);
+      return id;
+    };
+
+    for(auto &root : roots) id_of(root.second);
+
+    auto count_pos = writer.tell();
+    writer.put_u32(0);
+
+    std::vector<GCObject*> children;
+    for(size_t i = 0 ; i < queue.size() ; i++) {
+      auto obj = queue[i];
+      children.clear();
+      children_of(obj, children);
+
+      writer.put_byte(obj->type);
+      writer.put_u32(object_size(obj));
+      writer.put_u32(children.size());
+      for(auto child : children) writer.put_u32(id_of(child));
+    }
+    writer.patch_u32(count_pos, queue.size());
+
+    writer.put_u32(roots.size());
+    for(auto &root : roots) {
+      writer.put_string(root.first);
+      writer.put_u32(ids[root.second]);
+    }
+
+    // names of objects that weren't reached are dropped
+    std::vector<std::pair<std::string, uint32_t>> found;
+    for(auto &name : names) {
+      auto itr = ids.find(name.second);
+      if(itr != ids.end()) found.push_back(std::make_pair(name.first, itr->second));
+    }
+    writer.put_u32(found.size());
+    for(auto &name : found) {
+      writer.put_string(name.first);
+      writer.put_u32(name.second);
+    }
+
+    writer.flush();
+    return writer.good();
+  }
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Lisp {
+  class GCObject;
+
+  typedef std::vector<std::pair<std::string, GCObject*>> HeapLabels;
+
+  // writes every object reachable from roots, with its type, its size in bytes
+  // and the objects it refers to, to the file at path. names labels objects
+  // for the reader (e.g. globals by their variable names). read it with
+  // heap-analyze. returns false if the file can't be written.
+  bool heap_dump(const std::string &path, const HeapLabels &roots, const HeapLabels &names);
+}
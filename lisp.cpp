@@ -6,20 +6,26 @@
 #include <vector>
 #include <list>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <stack>
-#include <typeinfo>
 #include <stdexcept>
 #include <cstdlib>
+#include <deque>
+#include <exception>
 #include <ctype.h>
 
 #include <dlfcn.h>
 
 #include "lisp.h"
+#include "server.h"
+#include "module.h"
+#include "heapdump.h"
 
 #define PRINT_LINE (std::cout << "line: " << __LINE__ << std::endl)
 
 // cons must be pure list
-#define EACH_CONS(var, init) for(Cons* var = regard<Cons>(init) ; typeid(*var) != typeid(Nil) ; var = (Cons*)regard<Cons>(var)->cdr)
+#define EACH_CONS(var, init) for(Cons* var = regard<Cons>(init) ; var->type != TYPE_NIL ; var = (Cons*)regard<Cons>(var)->cdr)
 
 // for debug
 using std::cout;
@@ -33,13 +39,13 @@ namespace Lisp {
 
   class NameError : public Error {
   public:
-    NameError(Symbol *sym) : Error("undefined local variable " + sym->value, sym->loc) {}
+    NameError(Symbol *sym, Location loc) : Error("undefined local variable " + sym->value, loc) {}
   };
 
   class TypeError : public Error  {
   public:
-    TypeError(Object* obj, std::string expected_type) :
-      Error(obj->lisp_str() + " is not " + expected_type, obj->loc) {}
+    TypeError(Object* obj, std::string expected_type, Location loc) :
+      Error(obj->lisp_str() + " is not " + expected_type, loc) {}
   };
 
   class Parser {
@@ -47,6 +53,12 @@ namespace Lisp {
     std::vector<Object*> parse(const std::string &code) {
       tokens = tokenize(code);
 
+      integers.clear();
+      strings.clear();
+      symbols.clear();
+      nil = nullptr;
+      t   = nullptr;
+
       if(false) { // NOTE: for debug
         for(auto tok : tokens) {
           std::cout << tok->str() << std::endl;
@@ -63,6 +75,31 @@ namespace Lisp {
   private:
     std::list<Token*> tokens;
 
+    // every occurrence of the same literal or symbol in one parse shares one object.
+    // so only lists have a location; errors report the innermost one.
+    std::unordered_map<long, Integer*> integers;
+    std::unordered_map<std::string, String*> strings;
+    std::unordered_map<std::string, Symbol*> symbols;
+    Nil *nil;
+    T *t;
+
+    template<typename Obj> Obj* located(Obj *obj, Location loc) {
+      set_location(obj, loc);
+      return obj;
+    }
+
+    Nil* pooled_nil() {
+      if(!nil) nil = new Nil();
+      return nil;
+    }
+
+    template<typename Obj, typename Key, typename Value>
+    Obj* pooled(std::unordered_map<Key, Obj*> &pool, Key key, Value value) {
+      auto itr = pool.find(key);
+      if(itr != pool.end()) return itr->second;
+      return pool[key] = new Obj(value);
+    }
+
     inline Token* cur_token() {
       return tokens.empty() ? nullptr : tokens.front();
     }
@@ -77,7 +114,7 @@ namespace Lisp {
         //TODO: raise an error
       }
 
-      auto first_cons = new Cons(new Nil(), new Nil(), cur_token()->loc);
+      auto first_cons = located(new Cons(pooled_nil(), pooled_nil()), cur_token()->loc);
       auto cur_cons   = first_cons;
       size_t count = 0;
       while(true) {
@@ -87,7 +124,7 @@ namespace Lisp {
         if(cur_token()->type == TOKEN_BRACKET_CLOSE) break;
 
         if(count != 0) {
-          cur_cons->cdr = new Cons(new Nil(), new Nil(), cur_token()->loc);
+          cur_cons->cdr = located(new Cons(pooled_nil(), pooled_nil()), cur_token()->loc);
           cur_cons = (Cons*)cur_cons->cdr;
         }
         cur_cons->car = parse_expr();
@@ -111,15 +148,21 @@ namespace Lisp {
       switch(ttype) {
         case TOKEN_BRACKET_OPEN: return nullptr; //not reached
         case TOKEN_SYMBOL:
-          return new Symbol(ctoken->value, ctoken->loc);
-        case TOKEN_STRING:
-          return new String(ctoken->value, ctoken->loc);
-        case TOKEN_INTEGER:
-          return new Integer(ctoken->value, ctoken->loc);
+          return pooled(symbols, ctoken->value, ctoken->value);
+        case TOKEN_STRING: {
+          auto str = pooled(strings, ctoken->value, ctoken->value);
+          str->literal = true;
+          return str;
+        }
+        case TOKEN_INTEGER: {
+          long value = std::atol(ctoken->value.c_str());
+          return pooled(integers, value, value);
+        }
         case TOKEN_NIL:
-          return new Nil(ctoken->loc);
+          return pooled_nil();
         case TOKEN_T:
-          return new T(ctoken->loc);
+          if(!t) t = new T();
+          return t;
         default:
           throw std::logic_error("unknown token: " + std::to_string(cur_token()->type));
       }
@@ -224,226 +267,771 @@ namespace Lisp {
 
   class Evaluator {
     Environment *root_env, *cur_env;
+    std::ostream *out;
+    ConsTable *cons_table;
+
+    // objects native code holds while evaluation goes on (top-level forms,
+    // stream cursors); marked as gc roots
+    std::vector<Object*> roots;
+
+    // the lists being evaluated, innermost last; errors report the location
+    // of the innermost one that has one
+    std::vector<Cons*> forms;
+
+    // paths of the lisp modules require has loaded
+    std::unordered_set<std::string> loaded_modules;
+    // the frames of the requires being loaded, cut off from global_env meanwhile
+    std::vector<Environment*> requiring;
+
+    // green threads; see Task. current_task is nullptr until the first spawn,
+    // after which the main program is a task too
+    Task *current_task;
+    std::deque<Task*> run_queue;  // runnable tasks other than the current one
+    std::vector<Task*> waiting;   // tasks waiting for a task or a channel
+    Environment *global_env;      // where globals live: root_env, or a request's own environment
+
+    // a task is preempted after TICK_BUDGET evaluation steps or after allocating
+    // ALLOCATION_BUDGET objects, whichever comes first
+    static const size_t TICK_BUDGET = 1000;
+    static const size_t ALLOCATION_BUDGET = 4096;
+    size_t ticks, slice_start;
+
+    Task *finished_task; // its stack is released by the task that runs next
+
+    static Evaluator *running; // the evaluator task_entry runs tasks of
 
     Object* eval_expr(Object* obj) {
-      std::type_info const & id = typeid(*obj);
-      if(id == typeid(Cons)) {
-        auto list = (Cons*)obj;
-        auto name = regard<Symbol>(list->get(0))->value;
-        if(name == "print") {
-          std::cout << (evaluate(list->get(1)))->lisp_str() << std::endl;
-          return new Nil();
-        }
-        else if(name == "type") {
-          return new Symbol(std::string(typeid(*list->get(1)).name()));
-        }
-        else if(name == "tail") {
-          auto arg0  = regard<Cons>(evaluate(list->get(1)));
-          auto index = regard<Integer>(evaluate(list->get(2)));
-          return arg0->tail(index->value);
-        }
-        else if(name == "setq") {
-          auto val = evaluate(list->get(2));
-          cur_env->set(regard<Symbol>(list->get(1))->value, val);
-          return val;
-        }
-        else if(name == "defmacro") {
-          cur_env->set(regard<Symbol>(list->get(1))->value,
-            new Macro(regard<Cons>(list->get(2)), regard<Cons>(list->get(3))));
-        }
-        else if(name == "atom") {
-          auto val = evaluate(list->get(1));
-          if(typeid(*val) != typeid(Cons)) return new T();
-          else return new Nil();
-        }
-        else if(name == "+") {
-          Integer* sum = new Integer(0);
-
-          EACH_CONS(cc, list->cdr) {
-            sum->value += regard<Integer>(evaluate(cc->car))->value;
-          }
-          return sum;
-        }
-        else if(name == "-") {
-          Integer* sub = regard<Integer>(evaluate(list->get(1)));
+      if(!run_queue.empty() &&
+         (++ticks >= TICK_BUDGET || allocation_count() - slice_start >= ALLOCATION_BUDGET)) {
+        yield();
+      }
 
-          EACH_CONS(cc, list->tail(2)) {
-            sub->value -= regard<Integer>(evaluate(cc->car))->value;
-          }
-          return sub;
-        }
-        else if(name == "*") {
-          Integer* prod = new Integer(1);
+      // list->get past the end of a form, as in (print) or a call with too
+      // few arguments
+      if(!obj) throw Error("missing argument", form_location());
 
-          EACH_CONS(cc, list->cdr) {
-            prod->value *= regard<Integer>(evaluate(cc->car))->value;
-          }
-          return prod;
+      switch(obj->type) {
+        case TYPE_CONS:
+          return eval_list((Cons*)obj);
+        case TYPE_SYMBOL: {
+          auto name = (Symbol*)obj;
+          auto val = cur_env->get(name->value);
+          if(val != nullptr) return val;
+
+          throw NameError(name, form_location());
         }
-        else if(name == "=") {
-          // TODO: 他の型にも対応させる
-          auto x = regard<Integer>(evaluate(list->get(1)));
-          auto y = regard<Integer>(evaluate(list->get(2)));
+        default:
+          return obj;
+      }
+    }
+
+    Object* eval_list(Cons* list) {
+      forms.push_back(list);
+      Object *ret;
+      try {
+        ret = eval_form(list);
+      }
+      catch(...) {
+        forms.pop_back();
+        throw;
+      }
+      forms.pop_back();
+      return ret;
+    }
 
-          return (x->value == y->value ? (Object*)new T() : (Object*)new Nil());
+    Location form_location() {
+      for(auto itr = forms.rbegin() ; itr != forms.rend() ; itr++) {
+        auto loc = location_of(*itr);
+        if(loc.lineno >= 0) return loc;
+      }
+      return Location();
+    }
+
+    Object* eval_form(Cons* list) {
+      auto name = regard<Symbol>(list->get(0))->value;
+      if(name == "print") {
+        evaluate(list->get(1))->lisp_write(*out);
+        *out << std::endl;
+        return new Nil();
+      }
+      else if(name == "type") {
+        return new Symbol(type_name(list->get(1)->type));
+      }
+      else if(name == "tail") {
+        auto arg0  = regard<Cons>(evaluate(list->get(1)));
+        auto index = regard<Integer>(evaluate(list->get(2)));
+        return arg0->tail(index->value);
+      }
+      else if(name == "setq") {
+        auto val = evaluate(list->get(2));
+        assign(regard<Symbol>(list->get(1))->value, val);
+        return val;
+      }
+      else if(name == "defmacro") {
+        assign(regard<Symbol>(list->get(1))->value,
+          new Macro(regard<Cons>(list->get(2)), regard<Cons>(list->get(3))));
+      }
+      else if(name == "atom") {
+        auto val = evaluate(list->get(1));
+        if(val->type != TYPE_CONS) return new T();
+        else return new Nil();
+      }
+      else if(name == "+") {
+        Integer* sum = new Integer(0);
+
+        EACH_CONS(cc, list->cdr) {
+          sum->value += regard<Integer>(evaluate(cc->car))->value;
         }
-        else if(name == ">") {
-          auto x = regard<Integer>(evaluate(list->get(1)));
-          auto y = regard<Integer>(evaluate(list->get(2)));
+        return sum;
+      }
+      else if(name == "-") {
+        Integer* sub = new Integer(regard<Integer>(evaluate(list->get(1)))->value);
 
-          return (x->value > y->value ? (Object*)new T() : (Object*)new Nil());
+        EACH_CONS(cc, list->tail(2)) {
+          sub->value -= regard<Integer>(evaluate(cc->car))->value;
         }
-        else if(name == "mod") {
-          auto x = regard<Integer>(evaluate(list->get(1)));
-          auto y = regard<Integer>(evaluate(list->get(2)));
+        return sub;
+      }
+      else if(name == "*") {
+        Integer* prod = new Integer(1);
 
-          return new Integer(x->value % y->value);
+        EACH_CONS(cc, list->cdr) {
+          prod->value *= regard<Integer>(evaluate(cc->car))->value;
         }
-        else if(name == "let") {
-          Environment* env = new Environment();
-          auto pairs = regard<Cons>(list->get(1));
-          EACH_CONS(cc, pairs) {
-            auto kv = regard<Cons>(cc->car);
-            env->set(regard<Symbol>(kv->get(0))->value, kv->get(1));
-          }
-          cur_env = cur_env->down_env(env);
+        return prod;
+      }
+      else if(name == "=") {
+        // TODO: 他の型にも対応させる
+        auto x = regard<Integer>(evaluate(list->get(1)));
+        auto y = regard<Integer>(evaluate(list->get(2)));
 
-          Object* ret;
-          EACH_CONS(cc, list->tail(2)) {
-            ret = evaluate(cc->car);
-          }
+        return (x->value == y->value ? (Object*)new T() : (Object*)new Nil());
+      }
+      else if(name == "eq") {
+        auto x = evaluate(list->get(1));
+        auto y = evaluate(list->get(2));
+
+        return (x == y ? (Object*)new T() : (Object*)new Nil());
+      }
+      else if(name == ">") {
+        auto x = regard<Integer>(evaluate(list->get(1)));
+        auto y = regard<Integer>(evaluate(list->get(2)));
 
-          cur_env = cur_env->up_env();
+        return (x->value > y->value ? (Object*)new T() : (Object*)new Nil());
+      }
+      else if(name == "mod") {
+        auto x = regard<Integer>(evaluate(list->get(1)));
+        auto y = regard<Integer>(evaluate(list->get(2)));
 
-          return ret;
+        return new Integer(x->value % y->value);
+      }
+      else if(name == "let") {
+        Environment* env = Environment::new_frame();
+        auto pairs = regard<Cons>(list->get(1));
+        EACH_CONS(cc, pairs) {
+          auto kv = regard<Cons>(cc->car);
+          env->set(regard<Symbol>(kv->get(0))->value, kv->get(1));
         }
-        else if(name == "lambda") {
-          return new Lambda(regard<Cons>(list->get(1)), list->tail(2), cur_env);
+        cur_env = cur_env->down_env(env);
+
+        Object* ret;
+        EACH_CONS(cc, list->tail(2)) {
+          ret = evaluate(cc->car);
         }
-        else if(name == "cond") {
-          EACH_CONS(cc, list->tail(1)) {
-            auto pair = regard<Cons>(cc->get(0));
-            if(typeid(*evaluate(pair->get(0))) != typeid(Nil)) {
-              return evaluate(pair->get(1));
-            }
-          }
 
-          return new Nil();
+        cur_env = cur_env->up_env();
+
+        return ret;
+      }
+      else if(name == "lambda") {
+        auto args = regard<Cons>(list->get(1));
+        auto body = list->tail(2);
+        return new Lambda(args, body, capture(body, args));
+      }
+      else if(name == "cond") {
+        EACH_CONS(cc, list->tail(1)) {
+          auto pair = regard<Cons>(cc->get(0));
+          if(evaluate(pair->get(0))->type != TYPE_NIL) {
+            return evaluate(pair->get(1));
+          }
         }
-        else if(name == "for") {
-          auto counter_name = regard<Symbol>(list->get(1));
-          auto start        = regard<Integer>(evaluate(list->get(2)));
-          auto end          = regard<Integer>(evaluate(list->get(3)));
 
-          auto counter      = new Integer(start->value);
+        return new Nil();
+      }
+      else if(name == "for") {
+        auto counter_name = regard<Symbol>(list->get(1));
+        auto start        = regard<Integer>(evaluate(list->get(2)));
+        auto end          = regard<Integer>(evaluate(list->get(3)));
 
-          Environment *env = new Environment();
-          env->set(counter_name->value, counter);
+        Environment *env = Environment::new_frame();
 
-          cur_env = cur_env->down_env(env);
+        cur_env = cur_env->down_env(env);
 
-          for(; counter->value < end->value ; counter->value++) {
-            EACH_CONS(cc, list->tail(4)) {
-              evaluate(cc->get(0));
-            }
+        for(long i = start->value ; i < end->value ; i++) {
+          // bind a new Integer each time; objects may be shared, so they're never modified
+          env->bind(counter_name->value, new Integer(i));
+          EACH_CONS(cc, list->tail(4)) {
+            evaluate(cc->get(0));
           }
+        }
 
-          cur_env = cur_env->up_env();
+        cur_env = cur_env->up_env();
 
-          return new Nil();
-        }
-        else if(name == "cons") {
-          auto car = evaluate(list->get(1));
-          auto cdr = evaluate(list->get(2));
+        return new Nil();
+      }
+      else if(name == "cons") {
+        auto car = evaluate(list->get(1));
+        auto cdr = evaluate(list->get(2));
 
-          return new Cons(car, cdr);
+        return new Cons(car, cdr);
+      }
+      else if(name == "hash-cons") {
+        auto car = evaluate(list->get(1));
+        auto cdr = evaluate(list->get(2));
+
+        return cons_table->intern(car, cdr);
+      }
+      else if(name == "list") {
+        EACH_CONS(cc, list->cdr) {
+          //TODO: 評価する
         }
-        else if(name == "list") {
-          EACH_CONS(cc, list->cdr) {
-            //TODO: 評価する
-          }
-          return list->cdr;
-        }
-        else if(name == "number-of-objects") {
-          return new Integer(objects.size());
-        }
-        else if(name == "gc") {
-          mark();
-          sweep();
-          return new Nil();
-        }
-        else if(name == "require") {
-          // load dynamic module
-          auto modname = "plugin/" + regard<String>(evaluate(list->get(1)))->value + ".so";
-          auto handle = dlopen(modname.c_str(), RTLD_LAZY);
-          if(!handle) {
-            throw std::logic_error("can't load dynamic module: " + modname);
+        return list->cdr;
+      }
+      else if(name == "string-append") {
+        std::vector<String*> strs;
+        for(Object *rest = list->cdr ; rest->type == TYPE_CONS ; rest = ((Cons*)rest)->cdr) {
+          strs.push_back(regard<String>(evaluate(((Cons*)rest)->car)));
+        }
+        if(strs.empty()) return new String("");
+        return strs[0]->append(strs.data() + 1, strs.size() - 1);
+      }
+      else if(name == "substring") {
+        auto str   = regard<String>(evaluate(list->get(1)));
+        auto start = regard<Integer>(evaluate(list->get(2)));
+        auto end_obj = list->get(3);
+        long end     = end_obj ? regard<Integer>(evaluate(end_obj))->value : (long)str->length();
+
+        if(start->value < 0 || end < start->value || end > (long)str->length()) {
+          throw Error("substring out of range", form_location());
+        }
+        return str->substring(start->value, end);
+      }
+      else if(name == "string-length") {
+        return new Integer(regard<String>(evaluate(list->get(1)))->length());
+      }
+      else if(name == "string->symbol") {
+        return new Symbol(regard<String>(evaluate(list->get(1)))->str());
+      }
+      else if(name == "number->string") {
+        return new String(std::to_string(regard<Integer>(evaluate(list->get(1)))->value));
+      }
+      else if(name == "memoize") {
+        auto func = regard<Lambda>(evaluate(list->get(1)));
+        long capacity = 0;
+        if(list->get(2)) {
+          auto arg = regard<Integer>(evaluate(list->get(2)));
+          if(arg->value <= 0) throw Error("memoize capacity must be positive", form_location());
+          capacity = arg->value;
+        }
+        return new Memo(func, capacity);
+      }
+      else if(name == "delay") {
+        return new Promise(list->get(1), capture(list->get(1), nullptr));
+      }
+      else if(name == "force") {
+        return force(evaluate(list->get(1)));
+      }
+      else if(name == "cons-stream") {
+        return new Cons(evaluate(list->get(1)), new Promise(list->get(2), capture(list->get(2), nullptr)));
+      }
+      else if(name == "stream-car") {
+        return regard<Cons>(force(evaluate(list->get(1))))->car;
+      }
+      else if(name == "stream-cdr") {
+        return force(regard<Cons>(force(evaluate(list->get(1))))->cdr);
+      }
+      else if(name == "stream-map") {
+        // func and the cell are kept in roots while func runs, since a (gc) in
+        // it doesn't see native locals
+        auto func   = regard<Lambda>(evaluate(list->get(1)));
+        roots.push_back(func);
+        auto stream = force(evaluate(list->get(2)));
+        if(stream->type == TYPE_NIL) {
+          roots.pop_back();
+          return stream;
+        }
+
+        auto cell = regard<Cons>(stream);
+        roots.push_back(cell);
+        std::vector<Object*> args { cell->car };
+        // func runs before the promise of the rest is made
+        auto value = apply(func, args);
+        auto ret = new Cons(value, defer("stream-map", func, cell->cdr));
+        roots.resize(roots.size() - 2);
+        return ret;
+      }
+      else if(name == "stream-filter") {
+        auto func = regard<Lambda>(evaluate(list->get(1)));
+        roots.push_back(func);
+        roots.push_back(evaluate(list->get(2)));
+
+        Object *stream;
+        while((stream = force(roots.back()))->type != TYPE_NIL) {
+          auto cell = regard<Cons>(stream);
+          roots.back() = cell;
+          std::vector<Object*> args { cell->car };
+          if(apply(func, args)->type != TYPE_NIL) {
+            stream = new Cons(cell->car, defer("stream-filter", func, cell->cdr));
+            break;
           }
+          roots.back() = cell->cdr;
+        }
 
-          dlerror();
+        roots.resize(roots.size() - 2);
+        return stream;
+      }
+      else if(name == "stream-take") {
+        // the first n elements as a list. the cursor and the elements taken so
+        // far are kept in roots while the rest is forced
+        size_t base = roots.size();
+        roots.push_back(evaluate(list->get(1)));
+        auto n = regard<Integer>(evaluate(list->get(2)));
+
+        Object *stream = force(roots[base]);
+        for(long i = 0 ; i < n->value && stream->type != TYPE_NIL ; i++) {
+          auto cell = regard<Cons>(stream);
+          roots[base] = cell;
+          roots.push_back(cell->car);
+          // the rest isn't forced once the last element is taken
+          if(i + 1 < n->value) stream = force(cell->cdr);
+        }
 
-          auto init = (void(*)(void))dlsym(handle, "slisp_init");
+        Object *ret = new Nil();
+        for(size_t i = roots.size() ; i > base + 1 ; i--) {
+          ret = new Cons(roots[i - 1], ret);
+        }
+        roots.resize(base);
+        return ret;
+      }
+      else if(name == "stream-for-each") {
+        // walks the stream without holding on to its head, so the consumed part
+        // can be collected by a (gc) inside func
+        auto func = regard<Lambda>(evaluate(list->get(1)));
+        roots.push_back(func);
+        roots.push_back(evaluate(list->get(2)));
+
+        Object *stream;
+        while((stream = force(roots.back()))->type != TYPE_NIL) {
+          auto cell = regard<Cons>(stream);
+          roots.back() = cell;
+          std::vector<Object*> args { cell->car };
+          apply(func, args);
+          roots.back() = cell->cdr;
+        }
 
-          char *error = dlerror();
-          if(error) {
-            throw std::logic_error(error);
+        roots.resize(roots.size() - 2);
+        return new Nil();
+      }
+      else if(name == "open-lines") {
+        // a stream of the lines of a file, read on demand
+        auto src = evaluate(list->get(1));
+        LineReader *reader;
+        if(src->type == TYPE_LINE_READER) {
+          reader = (LineReader*)src;
+        }
+        else {
+          auto path = regard<String>(src);
+          reader = new LineReader(path->str());
+          if(!reader->is_open()) {
+            throw Error("can't open file: " + path->str(), form_location());
           }
+        }
+
+        std::string line;
+        if(!reader->read_line(line)) return new Nil();
+        return new Cons(new String(std::move(line)), defer("open-lines", reader));
+      }
+      else if(name == "number-of-objects") {
+        return new Integer(object_count());
+      }
+      else if(name == "heap-dump") {
+        auto path = regard<String>(evaluate(list->get(1)));
+        if(!dump_heap(path->str())) {
+          throw Error("can't write heap dump: " + path->str(), form_location());
+        }
+        return new Nil();
+      }
+      else if(name == "spawn") {
+        auto func = regard<Lambda>(evaluate(list->get(1)));
+        std::vector<Object*> args;
+        for(Object *rest = list->tail(2) ; rest->type == TYPE_CONS ; rest = ((Cons*)rest)->cdr) {
+          args.push_back(evaluate(((Cons*)rest)->car));
+        }
+        return spawn(func, args);
+      }
+      else if(name == "yield") {
+        yield();
+        return new Nil();
+      }
+      else if(name == "join") {
+        auto task = regard<Task>(evaluate(list->get(1)));
+        while(task->state != Task::DONE) wait_for(task);
+        if(task->failed) throw std::logic_error(task->error);
+        return task->result;
+      }
+      else if(name == "make-channel") {
+        long capacity = 0;
+        if(list->get(1)) {
+          auto arg = regard<Integer>(evaluate(list->get(1)));
+          if(arg->value < 0) throw Error("negative channel capacity", form_location());
+          capacity = arg->value;
+        }
+        start_tasks();
+        return new Channel(capacity);
+      }
+      else if(name == "send") {
+        auto chan = regard<Channel>(evaluate(list->get(1)));
+        auto val  = evaluate(list->get(2));
+        size_t seq = chan->sent++;
+        chan->items.push_back(val);
+        wake(chan);
+        while(chan->received + chan->capacity <= seq) wait_for(chan);
+        return val;
+      }
+      else if(name == "receive") {
+        auto chan = regard<Channel>(evaluate(list->get(1)));
+        while(chan->items.empty()) wait_for(chan);
+        auto val = chan->items.front();
+        chan->items.pop_front();
+        chan->received++;
+        wake(chan);
+        return val;
+      }
+      else if(name == "gc") {
+        mark();
+        sweep();
+        return new Nil();
+      }
+      else if(name == "require") {
+        auto module = regard<String>(evaluate(list->get(1)))->str();
+        if(load_module(module)) return new Nil();
+
+        // load dynamic module
+        auto modname = "plugin/" + module + ".so";
+        auto handle = dlopen(modname.c_str(), RTLD_LAZY);
+        if(!handle) {
+          throw std::logic_error("can't load dynamic module: " + modname);
+        }
+
+        dlerror();
 
-          (*init)();
+        auto init = (void(*)(void))dlsym(handle, "slisp_init");
 
-          return new Nil();
+        char *error = dlerror();
+        if(error) {
+          throw std::logic_error(error);
         }
-        else {
-          auto obj = evaluate(list->get(0));
-          if(typeid(*obj) == typeid(Lambda)) {
+
+        (*init)();
+
+        return new Nil();
+      }
+      else {
+        auto obj = evaluate(list->get(0));
+        switch(obj->type) {
+          case TYPE_LAMBDA: {
             Lambda* lambda = (Lambda*)obj;
 
-            Environment *env = new Environment();
+            std::vector<Object*> args;
             size_t index = 1;
             EACH_CONS(cc, lambda->args) {
-              if(typeid(*cc->car) == typeid(Nil)) break; //TODO なんとかする
-              auto name = regard<Symbol>(cc->car)->value;
-              env->set(name, evaluate(list->get(index)));
+              if(cc->car->type == TYPE_NIL) break; //TODO なんとかする
+              args.push_back(evaluate(list->get(index)));
 
               index++;
             }
-            env->set_lexical_parent(lambda->lexical_parent);
 
-            cur_env = cur_env->down_env(env);
+            return apply(lambda, args);
+          }
+          case TYPE_MEMO: {
+            Memo* memo = (Memo*)obj;
+
+            std::vector<Object*> args;
+            size_t index = 1;
+            EACH_CONS(cc, memo->func->args) {
+              if(cc->car->type == TYPE_NIL) break;
+              args.push_back(evaluate(list->get(index)));
 
-            Object* ret;
-            EACH_CONS(cc, lambda->body) {
-              ret = evaluate(cc->car);
+              index++;
             }
 
-            cur_env = cur_env->up_env();
+            auto ret = memo->lookup(args);
+            if(!ret) {
+              ret = apply(memo->func, args);
+              memo->store(args, ret);
+            }
             return ret;
           }
-          else if(typeid(*obj) == typeid(Macro)) {
+          case TYPE_MACRO: {
             Macro* mac = (Macro*)obj;
 
             auto expanded = mac->expand(list->tail(1));
             return evaluate(expanded);
           }
-          else {
+          default:
             throw std::logic_error("undefined function: " + name);
-          }
         }
       }
-      else if(id == typeid(Symbol)) {
-        auto name = (Symbol*)obj;
-        auto val = cur_env->get(name->value);
-        if(val != nullptr) return val;
 
-        throw NameError(name);
+      return list;
+    }
+
+    // sets name where it is bound, or binds it in cur_env. while serving, a
+    // request doesn't change root_env: it binds the globals it sets in its own
+    // environment instead, and they go away with it
+    void assign(std::string &name, Object *val) {
+      if(global_env != root_env && cur_env->get_env_by_name(name) == root_env) {
+        global_env->bind(name, val);
       }
+      else cur_env->set(name, val);
+    }
 
-      return obj;
+    static void collect_symbols(Object *expr, std::unordered_set<std::string> &names) {
+      while(expr->type == TYPE_CONS) {
+        auto cons = (Cons*)expr;
+        collect_symbols(cons->car, names);
+        expr = cons->cdr;
+      }
+      if(expr->type == TYPE_SYMBOL) names.insert(((Symbol*)expr)->value);
+    }
+
+    // builds the environment of a closure over body: the bindings of the
+    // symbols in body (other than params) that live in local frames, shared
+    // with those frames through boxes, so the frames themselves can be reused.
+    // globals aren't captured; lookups fall through to global_env, never to
+    // the caller's frames. symbols nothing binds yet may be bound later in the
+    // enclosing frames, and are looked up in their late_bindings first.
+    Environment* capture(Object *body, Cons *params) {
+      std::unordered_set<std::string> names;
+      collect_symbols(body, names);
+      if(params) {
+        EACH_CONS(cc, params) {
+          if(cc->car->type == TYPE_SYMBOL) names.erase(((Symbol*)cc->car)->value);
+        }
+      }
+
+      std::vector<std::pair<std::string, Environment*>> captured;
+      bool unbound = false;
+      for(auto name : names) {
+        auto owner = cur_env->get_env_by_name(name);
+        if(!owner) unbound = true;
+        else if(owner != root_env && owner != global_env) captured.push_back(std::make_pair(name, owner));
+      }
+
+      auto outer = (unbound && cur_env != global_env) ? cur_env->late_bindings(global_env) : global_env;
+      if(captured.empty()) return outer;
+
+      auto env = new Environment();
+      env->set_parent(outer);
+      for(auto &binding : captured) env->share(binding.first, binding.second);
+      return env;
+    }
+
+    Object* apply(Lambda *lambda, std::vector<Object*> &args) {
+      Environment *env = Environment::new_frame();
+      size_t index = 0;
+      EACH_CONS(cc, lambda->args) {
+        if(cc->car->type == TYPE_NIL) break; //TODO なんとかする
+        if(index >= args.size()) break;
+        env->set(regard<Symbol>(cc->car)->value, args[index]);
+
+        index++;
+      }
+      env->set_lexical_parent(lambda->lexical_parent);
+
+      cur_env = cur_env->down_env(env);
+
+      Object* ret;
+      EACH_CONS(cc, lambda->body) {
+        ret = evaluate(cc->car);
+      }
+
+      cur_env = cur_env->up_env();
+      return ret;
+    }
+
+    Object* force(Object *obj) {
+      if(obj->type != TYPE_PROMISE) return obj;
+
+      auto promise = (Promise*)obj;
+      if(!promise->forced()) {
+        // the caller may be the only one holding the promise
+        roots.push_back(promise);
+        Environment *env = Environment::new_frame();
+        env->set_lexical_parent(promise->env);
+
+        cur_env = cur_env->down_env(env);
+        auto value = evaluate(promise->expr);
+        cur_env = cur_env->up_env();
+
+        // forcing may have forced this promise already
+        if(!promise->forced()) promise->resolve(value);
+        roots.pop_back();
+      }
+      return promise->value;
+    }
+
+    void start_tasks() {
+      if(current_task) return;
+      current_task = new Task(nullptr, std::vector<Object*>());
+      current_task->use_thread_stack();
+      running = this;
+    }
+
+    Task* spawn(Lambda *func, std::vector<Object*> &args) {
+      start_tasks();
+      auto task = new Task(func, args);
+      task->base = Environment::new_frame();
+      task->base->set_parent(global_env);
+      task->env = task->base;
+      task->prepare(&Evaluator::task_entry);
+      run_queue.push_back(task);
+      return task;
+    }
+
+    static void task_entry() {
+      running->run_task();
+    }
+
+    void run_task() {
+      release_finished();
+
+      auto task = current_task;
+      try {
+        task->result = apply(task->func, task->args);
+      }
+      catch(std::exception &e) {
+        task->failed = true;
+        task->error  = e.what();
+      }
+
+      // pop the frames an error unwound through, then the bottom one
+      while(cur_env != task->base) cur_env = cur_env->up_env();
+      cur_env = task->base->up_env();
+      task->base = nullptr;
+      task->func = nullptr;
+      task->args.clear();
+      roots.clear();
+
+      task->state = Task::DONE;
+      wake(task);
+      finished_task = task;
+
+      if(run_queue.empty()) wake_deadlocked();
+      switch_task(); // doesn't return
+    }
+
+    void release_finished() {
+      if(finished_task) finished_task->release_stack();
+      finished_task = nullptr;
+    }
+
+    // suspends the current task and resumes the first one in run_queue. the
+    // caller has queued the current task again, made it wait or finished it
+    void switch_task() {
+      auto from = current_task;
+      auto to = run_queue.front();
+      run_queue.pop_front();
+      ticks = 0;
+      slice_start = allocation_count();
+      if(to == from) return;
+
+      from->env = cur_env;
+      from->roots.swap(roots);
+      from->forms.swap(forms);
+      char here;
+      from->suspended_at = &here;
+
+      current_task = to;
+      cur_env = to->env;
+      roots.swap(to->roots);
+      forms.swap(to->forms);
+
+      swapcontext(&from->context, &to->context);
+      release_finished();
+    }
+
+    void yield() {
+      if(run_queue.empty()) return;
+      run_queue.push_back(current_task);
+      switch_task();
+    }
+
+    // suspends the current task until wake(obj)
+    void wait_for(Object *obj) {
+      auto task = current_task;
+      task->state = Task::WAITING;
+      task->waiting_on = obj;
+      waiting.push_back(task);
+
+      if(run_queue.empty()) wake_deadlocked();
+      switch_task();
+
+      if(task->deadlocked) {
+        task->deadlocked = false;
+        throw std::logic_error("deadlock: every task is waiting");
+      }
+    }
+
+    // makes the tasks waiting for obj runnable; they check again what they wait for
+    void wake(Object *obj) {
+      for(auto itr = waiting.begin() ; itr != waiting.end() ; ) {
+        auto task = *itr;
+        if(task->waiting_on == obj) {
+          task->state = Task::RUNNABLE;
+          task->waiting_on = nullptr;
+          run_queue.push_back(task);
+          itr = waiting.erase(itr);
+        }
+        else itr++;
+      }
+    }
+
+    // nothing is runnable, so nothing can wake the waiting tasks: wake them
+    // all with an error instead
+    void wake_deadlocked() {
+      for(auto task : waiting) {
+        task->state = Task::RUNNABLE;
+        task->waiting_on = nullptr;
+        task->deadlocked = true;
+        run_queue.push_back(task);
+      }
+      waiting.clear();
+    }
+
+    // a promise of (name args...). evaluating the call must not evaluate the
+    // args again, so ones that aren't self-evaluating are passed as forced promises
+    template<typename... Args> Promise* defer(const char *name, Args... args) {
+      std::vector<Object*> items { (Object*)args... };
+
+      Object *expr = new Nil();
+      for(auto itr = items.rbegin() ; itr != items.rend() ; itr++) {
+        Object *arg = *itr;
+        if(arg->type == TYPE_CONS || arg->type == TYPE_SYMBOL) {
+          auto promise = new Promise(nullptr, nullptr);
+          promise->resolve(arg);
+          arg = promise;
+        }
+        expr = new Cons(arg, expr);
+      }
+      return new Promise(new Cons(new Symbol(name), expr), nullptr);
     }
 
   public:
-    Evaluator() {
-      root_env = cur_env = new Environment();
+    Evaluator()
+      : out(&std::cout), cons_table(new ConsTable()), current_task(nullptr),
+        ticks(0), slice_start(0), finished_task(nullptr) {
+      root_env = cur_env = global_env = new Environment();
     }
 
     Object* evaluate(Object* expr) {
@@ -451,69 +1039,250 @@ namespace Lisp {
     }
 
     Object* evaluate(std::vector<Object*> exprs) {
+      size_t base = roots.size();
+      roots.insert(roots.end(), exprs.begin(), exprs.end());
+
       Object *ret;
-      for(auto &expr : exprs) {
-        ret = evaluate(expr);
+      try {
+        for(auto &expr : exprs) {
+          ret = evaluate(expr);
+        }
+      }
+      catch(...) {
+        roots.resize(base);
+        throw;
       }
+
+      roots.resize(base);
       return ret;
     }
 
+    // evaluates name.lisp from the module search path, once, in global_env
+    // wherever the require is. the parsed forms are cached, so loading the same
+    // source again skips tokenizing and parsing; they're kept unexpanded, since
+    // the macros they call may come from other modules. returns false if there
+    // is no such module.
+    bool load_module(const std::string &name) {
+      auto path = find_module(name);
+      if(path.empty()) return false;
+      if(!loaded_modules.insert(path).second) return true;
+
+      std::ifstream ifs(path);
+      std::string code((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+      auto hash = content_hash(code);
+
+      // the calls the module makes go down from global_env, which takes over
+      // its link to the frames of the require until they are back
+      auto saved_env   = cur_env;
+      auto saved_child = global_env->child_env();
+      requiring.push_back(saved_env);
+      cur_env = global_env;
+
+      try {
+        std::vector<Object*> forms;
+        if(!read_cache(cache_path(path), hash, forms)) {
+          Parser parser;
+          forms = parser.parse(code);
+          write_cache(cache_path(path), hash, forms);
+        }
+        evaluate(forms);
+      }
+      catch(...) {
+        while(cur_env != global_env) cur_env = cur_env->up_env();
+        if(saved_child) global_env->down_env(saved_child);
+        cur_env = saved_env;
+        requiring.pop_back();
+        loaded_modules.erase(path);
+        throw;
+      }
+
+      if(saved_child) global_env->down_env(saved_child);
+      cur_env = saved_env;
+      requiring.pop_back();
+      return true;
+    }
+
+    // evaluates exprs in a fresh child of root_env with print redirected to aout,
+    // then collects everything the evaluation left behind. globals the exprs set
+    // are bound in the child (see assign), so root_env is left as it was
+    void evaluate_isolated(std::vector<Object*> exprs, std::ostream &aout) {
+      auto saved_out = out;
+      // modules the request loads are bound in env, which goes away with it
+      auto saved_modules = loaded_modules;
+      // not a pooled frame: closures made by the request refer to it
+      auto env = cur_env->down_env(new Environment());
+      cur_env = global_env = env;
+      out = &aout;
+
+      std::exception_ptr error;
+      try {
+        evaluate(exprs);
+      }
+      catch(...) {
+        error = std::current_exception();
+        // pop the frames the error unwound through, so pooled ones are reused
+        while(cur_env != env) cur_env = cur_env->up_env();
+      }
+
+      // tasks the request spawned print to aout and live in env
+      finish_tasks();
+
+      cur_env = global_env = env->up_env();
+      out = saved_out;
+      loaded_modules.swap(saved_modules);
+      mark();
+      sweep();
+
+      if(error) std::rethrow_exception(error);
+    }
+
+    // runs the other tasks until every one of them has finished
+    void finish_tasks() {
+      while(!run_queue.empty() || !waiting.empty()) {
+        if(run_queue.empty()) wake_deadlocked();
+        yield();
+      }
+    }
+
+    // dumps what the gc roots reach, with the globals named
+    bool dump_heap(const std::string &path) {
+      HeapLabels heap_roots { { "root_env", root_env }, { "cons_table", cons_table } };
+      for(auto obj : roots) heap_roots.push_back(std::make_pair("native", obj));
+      if(current_task) {
+        heap_roots.push_back(std::make_pair("current task", current_task));
+        heap_roots.push_back(std::make_pair("cur_env", cur_env));
+      }
+      for(auto task : run_queue) heap_roots.push_back(std::make_pair("runnable task", task));
+      for(auto task : waiting) heap_roots.push_back(std::make_pair("waiting task", task));
+
+      HeapLabels names;
+      for(auto &kv : root_env->bindings()) names.push_back(std::make_pair(kv.first, kv.second));
+
+      return heap_dump(path, heap_roots, names);
+    }
+
+    // the current task and the suspended ones
+    std::vector<Task*> tasks() {
+      std::vector<Task*> all;
+      if(!current_task) return all;
+      all.push_back(current_task);
+      all.insert(all.end(), run_queue.begin(), run_queue.end());
+      all.insert(all.end(), waiting.begin(), waiting.end());
+      return all;
+    }
+
     void mark() {
-      root_env->mark();
+      std::vector<GCObject*> gc_roots { root_env, cons_table, cur_env };
+      gc_roots.insert(gc_roots.end(), roots.begin(), roots.end());
+      gc_roots.insert(gc_roots.end(), forms.begin(), forms.end());
+      gc_roots.insert(gc_roots.end(), requiring.begin(), requiring.end());
+
+      // the other tasks are suspended inside evaluation; what their native
+      // frames and saved registers hold is found by scanning them
+      MemoryRanges stacks;
+      for(auto task : tasks()) {
+        gc_roots.push_back(task);
+        if(task == current_task || !task->suspended_at) continue;
+        stacks.push_back(std::make_pair(task->suspended_at, task->stack_top));
+        stacks.push_back(std::make_pair((const char*)&task->context, (const char*)(&task->context + 1)));
+      }
+      mark_from(gc_roots, stacks);
     }
 
     void sweep() {
-      for(auto itr = objects.begin() ; itr != objects.end() ; ) {
-        auto obj = *itr;
-        if(!obj->mark_flag) {
-          delete obj;
-          itr = objects.erase(itr);
-          continue;
-        }
-        else {
-          obj->mark_flag = false;
-        }
-        itr++;
+      for(auto obj : weak_objects) {
+        if(obj->mark_flag) obj->clear_weak();
       }
+
+      sweep_lazily();
+
+      Environment::unmark_frames();
     }
 
     template<typename T> T* regard(Object* expr) {
-      if(typeid(*expr) != typeid(T)) {
-        throw TypeError(expr, std::string(typeid(T).name()));
+      if(!expr) throw Error("missing argument", form_location());
+      if(expr->type != T::TYPE) {
+        throw TypeError(expr, type_name(T::TYPE), form_location());
       }
       return (T*)expr;
     }
   };
 
-  std::vector<Object*> parse(std::string &code) {
+  Evaluator* Evaluator::running = nullptr;
+
+  std::vector<Object*> parse(const std::string &code) {
     Parser p;
     return p.parse(code);
   }
 
-  void clean_up() {
-    for(auto obj : objects) {
-      delete obj;
+  std::string serve_request(Evaluator &evaluator, const std::string &code) {
+    std::stringstream out;
+    try {
+      evaluator.evaluate_isolated(parse(code), out);
+    }
+    catch(std::exception &e) {
+      out << "error: " << e.what() << std::endl;
     }
+    return out.str();
+  }
+
+  void clean_up() {
+    destroy_all();
+    Environment::clear_frame_pool();
+    clear_stack_pool();
   }
 }
 
-int main() {
+int main(int argc, char **argv) {
   using namespace std;
 
+  string serve_path, client_path, heap_dump_path;
+  size_t workers = 4;
+  for(int i = 1 ; i < argc ; i++) {
+    string arg = argv[i];
+    if(arg == "--serve" && i + 1 < argc) serve_path = argv[++i];
+    else if(arg == "--client" && i + 1 < argc) client_path = argv[++i];
+    else if(arg == "--workers" && i + 1 < argc) workers = max(atoi(argv[++i]), 1);
+    else if(arg == "--heap-dump-on-exit" && i + 1 < argc) heap_dump_path = argv[++i];
+    else {
+      cerr << "usage: " << argv[0] << " [--serve SOCKET [--workers N] | --client SOCKET] [--heap-dump-on-exit DUMP] < FILE" << endl;
+      return 1;
+    }
+  }
+
+  if(!client_path.empty()) {
+    string code((istreambuf_iterator<char>(cin)), istreambuf_iterator<char>());
+    string response;
+    if(!Lisp::request(client_path, code, response)) {
+      cerr << "request to '" << client_path << "' failed" << endl;
+      return 1;
+    }
+    cout << response;
+    return 0;
+  }
+
   Lisp::Evaluator evaluator;
 
   // load standard module
-  ifstream stdmod_ifs("std.lisp");
-  if(stdmod_ifs.fail()) {
+  if(!evaluator.load_module("std")) {
     cerr << "failed to load 'std.lisp'!" << endl;
     Lisp::clean_up();
     return 1;
   }
-  string stdmod((istreambuf_iterator<char>(stdmod_ifs)), istreambuf_iterator<char>());
-  evaluator.evaluate(Lisp::parse(stdmod));
+
+  if(!serve_path.empty()) {
+    Lisp::serve(serve_path, workers, [&](const string &code) {
+      return Lisp::serve_request(evaluator, code);
+    });
+  }
 
   string code((istreambuf_iterator<char>(cin)), istreambuf_iterator<char>());
   evaluator.evaluate(Lisp::parse(code));
+  evaluator.finish_tasks();
+
+  if(!heap_dump_path.empty() && !evaluator.dump_heap(heap_dump_path)) {
+    cerr << "failed to write heap dump '" << heap_dump_path << "'" << endl;
+  }
 
   Lisp::clean_up();
 
@@ -2,5 +2,7 @@
 
 #include "object.h"
 #include "environment.h"
+#include "memo.h"
+#include "task.h"
 #include "gc.h"
 #include "token.h"
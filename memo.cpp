@@ -0,0 +1,213 @@
+#include "memo.h"
+
+#include <algorithm>
+#include <functional>
+
+namespace Lisp {
+  static size_t combine(size_t h, size_t v) {
+    return h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+  }
+
+  static size_t hash_bytes(const char *data, size_t len) {
+    size_t h = 14695981039346656037ULL; // FNV-1a
+    for(size_t i = 0 ; i < len ; i++) {
+      h = (h ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return h;
+  }
+
+  size_t structural_hash(Object *obj) {
+    size_t h = 0;
+    // walk cdrs iteratively so long lists don't recurse deeply
+    while(obj->type == TYPE_CONS) {
+      auto cons = (Cons*)obj;
+      h = combine(h, structural_hash(cons->car));
+      obj = cons->cdr;
+    }
+
+    switch(obj->type) {
+      case TYPE_INTEGER: return combine(h, std::hash<long>()(((Integer*)obj)->value));
+      case TYPE_SYMBOL:  return combine(h, std::hash<std::string>()(((Symbol*)obj)->value));
+      case TYPE_STRING:  return combine(h, hash_bytes(((String*)obj)->data(), ((String*)obj)->length()));
+      case TYPE_NIL:     return combine(h, 1);
+      case TYPE_T:       return combine(h, 2);
+      default:           return combine(h, std::hash<Object*>()(obj));
+    }
+  }
+
+  bool structural_equal(Object *x, Object *y) {
+    while(x != y) {
+      if(x->type != y->type) return false;
+
+      switch(x->type) {
+        case TYPE_CONS:
+          if(!structural_equal(((Cons*)x)->car, ((Cons*)y)->car)) return false;
+          x = ((Cons*)x)->cdr;
+          y = ((Cons*)y)->cdr;
+          continue;
+        case TYPE_INTEGER: return ((Integer*)x)->value == ((Integer*)y)->value;
+        case TYPE_SYMBOL:  return ((Symbol*)x)->value == ((Symbol*)y)->value;
+        case TYPE_STRING: {
+          auto sx = (String*)x, sy = (String*)y;
+          return sx->length() == sy->length() && std::equal(sx->data(), sx->data() + sx->length(), sy->data());
+        }
+        case TYPE_NIL:
+        case TYPE_T:
+          return true;
+        default:
+          return false;
+      }
+    }
+    return true;
+  }
+
+  bool is_structural(Object *obj) {
+    while(obj->type == TYPE_CONS) {
+      if(!is_structural(((Cons*)obj)->car)) return false;
+      obj = ((Cons*)obj)->cdr;
+    }
+
+    switch(obj->type) {
+      case TYPE_INTEGER: case TYPE_SYMBOL: case TYPE_STRING: case TYPE_NIL: case TYPE_T:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  Memo::Memo(Lambda *afunc, size_t acapacity)
+    : Object(TYPE), func(afunc), capacity(acapacity) {
+    weak_objects.insert(this);
+  }
+
+  Memo::~Memo() {
+    weak_objects.erase(this);
+  }
+
+  size_t Memo::hash_args(Args &args) {
+    size_t h = args.size();
+    for(auto arg : args) h = combine(h, structural_hash(arg));
+    return h;
+  }
+
+  Object* Memo::lookup(Args &args) {
+    auto range = table.equal_range(hash_args(args));
+    for(auto itr = range.first ; itr != range.second ; itr++) {
+      auto entry = itr->second;
+      if(entry->args.size() != args.size()) continue;
+
+      bool same = true;
+      for(size_t i = 0 ; same && i < args.size() ; i++) {
+        same = structural_equal(entry->args[i], args[i]);
+      }
+      if(same) {
+        entries.splice(entries.begin(), entries, entry);
+        return entry->value;
+      }
+    }
+    return nullptr;
+  }
+
+  void Memo::store(Args &args, Object *value) {
+    size_t h = hash_args(args);
+    bool weak = false;
+    for(auto arg : args) weak = weak || !is_structural(arg);
+    entries.push_front(Entry { h, args, value, weak });
+    table.emplace(h, entries.begin());
+
+    if(capacity > 0 && entries.size() > capacity) {
+      auto last = std::prev(entries.end());
+      auto range = table.equal_range(last->hash);
+      for(auto itr = range.first ; itr != range.second ; itr++) {
+        if(itr->second == last) {
+          table.erase(itr);
+          break;
+        }
+      }
+      entries.erase(last);
+    }
+  }
+
+  void Memo::mark_children(Marker &marker) {
+    marker.mark(func);
+    for(auto &entry : entries) {
+      // arguments compared by identity are weak
+      for(auto arg : entry.args) {
+        if(!entry.weak || is_structural(arg)) marker.mark(arg);
+      }
+      marker.mark(entry.value);
+    }
+  }
+
+  void Memo::clear_weak() {
+    for(auto itr = table.begin() ; itr != table.end() ; ) {
+      auto entry = itr->second;
+      bool live = true;
+      if(entry->weak) {
+        for(auto arg : entry->args) live = live && arg->mark_flag;
+      }
+
+      if(live) {
+        itr++;
+      }
+      else {
+        entries.erase(entry);
+        itr = table.erase(itr);
+      }
+    }
+  }
+
+  std::string Memo::lisp_str() { return "#<memoized " + func->lisp_str() + ">"; }
+
+  ConsTable::ConsTable() : GCObject(TYPE_CONS_TABLE) {
+    weak_objects.insert(this);
+  }
+
+  ConsTable::~ConsTable() {
+    weak_objects.erase(this);
+  }
+
+  // a tree hash, combine(hash(car), hash(cdr)), so the cached hash of an
+  // interned cons stands for its whole subtree
+  size_t ConsTable::hash(Object *obj) {
+    std::vector<Cons*> spine;
+    auto cached = hashes.end();
+    while(obj->type == TYPE_CONS && (cached = hashes.find((Cons*)obj)) == hashes.end()) {
+      spine.push_back((Cons*)obj);
+      obj = ((Cons*)obj)->cdr;
+    }
+
+    size_t h = cached != hashes.end() ? cached->second : structural_hash(obj);
+    for(auto itr = spine.rbegin() ; itr != spine.rend() ; itr++) {
+      h = combine(hash((*itr)->car), h);
+    }
+    return h;
+  }
+
+  Cons* ConsTable::intern(Object *car, Object *cdr) {
+    size_t h = combine(hash(car), hash(cdr));
+
+    auto range = table.equal_range(h);
+    for(auto itr = range.first ; itr != range.second ; itr++) {
+      auto cons = itr->second;
+      if(structural_equal(cons->car, car) && structural_equal(cons->cdr, cdr)) return cons;
+    }
+
+    auto cons = new Cons(car, cdr);
+    table.emplace(h, cons);
+    hashes[cons] = h;
+    return cons;
+  }
+
+  void ConsTable::clear_weak() {
+    for(auto itr = table.begin() ; itr != table.end() ; ) {
+      if(itr->second->mark_flag) {
+        itr++;
+      }
+      else {
+        hashes.erase(itr->second);
+        itr = table.erase(itr);
+      }
+    }
+  }
+}
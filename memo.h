@@ -0,0 +1,74 @@
+#pragma once
+
+#include "object.h"
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+
+namespace Lisp {
+  // hash and equality over the structure of Integer, Symbol, String, Nil, T and
+  // Cons; other objects are compared by identity
+  size_t structural_hash(Object *obj);
+  bool structural_equal(Object *x, Object *y);
+  // whether obj is compared by structure all the way down
+  bool is_structural(Object *obj);
+
+  // (memoize f [capacity]): caches f's results by argument tuple. an entry
+  // whose arguments are all compared by structure is kept until it is evicted;
+  // one with an argument compared by identity (a lambda, a promise, ...) is
+  // weak: gc drops it once such an argument is otherwise unreachable, as no
+  // later call could match it. with a capacity the least recently used entry
+  // is evicted first.
+  class Memo : public Object {
+  public:
+    static const ObjectType TYPE = TYPE_MEMO;
+
+  private:
+    typedef std::vector<Object*> Args;
+
+    struct Entry {
+      size_t hash;
+      Args args;
+      Object *value;
+      bool weak; // some argument is compared by identity
+    };
+
+    std::list<Entry> entries; // most recently used first
+    std::unordered_multimap<size_t, std::list<Entry>::iterator> table;
+
+    size_t hash_args(Args &args);
+
+  public:
+    Lambda *func;
+    size_t capacity; // 0 for unbounded
+
+    Memo(Lambda *afunc, size_t acapacity);
+    ~Memo();
+
+    Object* lookup(Args &args);
+    void store(Args &args, Object *value);
+
+    void mark_children(Marker &marker);
+    void clear_weak();
+
+    std::string lisp_str();
+  };
+
+  // interns conses for (hash-cons car cdr) so that structurally equal ones are
+  // the same object. entries are weak like Memo's.
+  class ConsTable : public GCObject {
+    std::unordered_multimap<size_t, Cons*> table;
+    std::unordered_map<Cons*, size_t> hashes;
+
+    size_t hash(Object *obj);
+
+  public:
+    ConsTable();
+    ~ConsTable();
+
+    Cons* intern(Object *car, Object *cdr);
+
+    void clear_weak();
+  };
+}
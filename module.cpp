@@ -0,0 +1,283 @@
+#include "module.h"
+#include "object.h"
+
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <unordered_map>
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+
+namespace Lisp {
+  // change the last byte when the format changes
+  static const char CACHE_MAGIC[4] = { 'S', 'L', 'C', '2' };
+
+  std::string find_module(const std::string &name) {
+    std::vector<std::string> dirs { "." };
+
+    const char *lisp_path = std::getenv("LISP_PATH");
+    if(lisp_path) {
+      std::stringstream ss(lisp_path);
+      std::string dir;
+      while(std::getline(ss, dir, ':')) {
+        if(!dir.empty()) dirs.push_back(dir);
+      }
+    }
+
+    for(auto &dir : dirs) {
+      auto path = dir + "/" + name + ".lisp";
+      if(access(path.c_str(), R_OK) == 0) return path;
+    }
+    return "";
+  }
+
+  // FNV-1a
+  uint64_t content_hash(const std::string &code) {
+    uint64_t hash = 14695981039346656037ULL;
+    for(unsigned char c : code) {
+      hash ^= c;
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  std::string cache_path(const std::string &source_path) {
+    return source_path + "c";
+  }
+
+  // the format, with integers big-endian:
+  //   magic, type name count (u32), type names (u32 length + bytes each),
+  //   content hash (u64),
+  //   object count (u32), objects, form count (u32), form ids (u32 each)
+  // an object is its type tag (u8), line and column (u32 each), then
+  //   String, Symbol: u32 length + bytes
+  //   Integer:        u64
+  //   Cons:           car id, cdr id (u32 each)
+  //   Nil, T:         nothing
+  // ids are indices into the objects, so objects the parser pooled stay shared.
+  // a cache whose type names differ from the interpreter's, as after the type
+  // tags are renumbered, is ignored.
+
+  class CacheWriter {
+    std::string buf;
+    std::unordered_map<Object*, uint32_t> ids;
+    std::vector<Object*> objects;
+
+  public:
+    void put_u32(uint32_t n) {
+      for(int shift = 24 ; shift >= 0 ; shift -= 8) buf += (char)(n >> shift);
+    }
+
+    void put_u64(uint64_t n) {
+      put_u32(n >> 32);
+      put_u32(n);
+    }
+
+    void put_string(const std::string &str) {
+      put_u32(str.size());
+      buf += str;
+    }
+
+    // numbers obj and everything it reaches, without recursion
+    bool collect(Object *root) {
+      std::vector<Object*> pending { root };
+      while(!pending.empty()) {
+        auto obj = pending.back();
+        pending.pop_back();
+        if(ids.count(obj)) continue;
+
+        switch(obj->type) {
+          case TYPE_CONS:
+            pending.push_back(((Cons*)obj)->car);
+            pending.push_back(((Cons*)obj)->cdr);
+            break;
+          case TYPE_STRING: case TYPE_SYMBOL: case TYPE_INTEGER: case TYPE_NIL: case TYPE_T:
+            break;
+          default:
+            return false; // not something a source file can contain
+        }
+        ids[obj] = objects.size();
+        objects.push_back(obj);
+      }
+      return true;
+    }
+
+    bool write(const std::string &path, uint64_t hash, const std::vector<Object*> &forms) {
+      for(auto form : forms) {
+        if(!collect(form)) return false;
+      }
+
+      buf.append(CACHE_MAGIC, sizeof(CACHE_MAGIC));
+      put_u32(TYPE_COUNT);
+      for(int type = 0 ; type < TYPE_COUNT ; type++) put_string(type_name((ObjectType)type));
+      put_u64(hash);
+
+      put_u32(objects.size());
+      for(auto obj : objects) {
+        auto loc = location_of(obj);
+        buf += (char)obj->type;
+        put_u32(loc.lineno);
+        put_u32(loc.colno);
+
+        switch(obj->type) {
+          case TYPE_STRING:  put_string(((String*)obj)->str()); break;
+          case TYPE_SYMBOL:  put_string(((Symbol*)obj)->value); break;
+          case TYPE_INTEGER: put_u64(((Integer*)obj)->value); break;
+          case TYPE_CONS:
+            put_u32(ids[((Cons*)obj)->car]);
+            put_u32(ids[((Cons*)obj)->cdr]);
+            break;
+          default: break;
+        }
+      }
+
+      put_u32(forms.size());
+      for(auto form : forms) put_u32(ids[form]);
+
+      // write to a temporary file and rename it, so that another interpreter
+      // loading the module never reads a half-written cache
+      auto tmp_path = path + "." + std::to_string(getpid());
+      {
+        std::ofstream ofs(tmp_path, std::ios::binary);
+        if(!ofs.write(buf.data(), buf.size())) {
+          std::remove(tmp_path.c_str());
+          return false;
+        }
+      }
+      if(std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        return false;
+      }
+      return true;
+    }
+  };
+
+  class CacheReader {
+    std::string buf;
+    size_t pos;
+
+  public:
+    CacheReader(std::string abuf) : buf(std::move(abuf)), pos(0) {}
+
+    bool get_u32(uint32_t &n) {
+      if(buf.size() - pos < 4) return false;
+      n = 0;
+      for(int i = 0 ; i < 4 ; i++) n = (n << 8) | (unsigned char)buf[pos++];
+      return true;
+    }
+
+    bool get_u64(uint64_t &n) {
+      uint32_t hi, lo;
+      if(!get_u32(hi) || !get_u32(lo)) return false;
+      n = ((uint64_t)hi << 32) | lo;
+      return true;
+    }
+
+    bool get_string(std::string &str) {
+      uint32_t len;
+      if(!get_u32(len) || buf.size() - pos < len) return false;
+      str = buf.substr(pos, len);
+      pos += len;
+      return true;
+    }
+
+    bool read(uint64_t hash, std::vector<Object*> &forms) {
+      if(buf.compare(0, sizeof(CACHE_MAGIC), CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0) return false;
+      pos = sizeof(CACHE_MAGIC);
+
+      uint32_t type_count;
+      if(!get_u32(type_count) || type_count != TYPE_COUNT) return false;
+      for(int type = 0 ; type < TYPE_COUNT ; type++) {
+        std::string name;
+        if(!get_string(name) || name != type_name((ObjectType)type)) return false;
+      }
+
+      uint64_t cached_hash;
+      if(!get_u64(cached_hash) || cached_hash != hash) return false;
+
+      uint32_t count;
+      if(!get_u32(count)) return false;
+
+      // conses may refer to objects later in the file; their links are filled
+      // in once every object exists
+      std::vector<Object*> objects;
+      std::vector<std::pair<uint32_t, uint32_t>> links;
+      for(uint32_t i = 0 ; i < count ; i++) {
+        if(pos >= buf.size()) return false;
+        auto type = (ObjectType)(unsigned char)buf[pos++];
+
+        uint32_t lineno, colno;
+        if(!get_u32(lineno) || !get_u32(colno)) return false;
+
+        Object *obj;
+        std::string str;
+        switch(type) {
+          case TYPE_STRING: {
+            if(!get_string(str)) return false;
+            auto literal = new String(str);
+            literal->literal = true;
+            obj = literal;
+            break;
+          }
+          case TYPE_SYMBOL:
+            if(!get_string(str)) return false;
+            obj = new Symbol(str);
+            break;
+          case TYPE_INTEGER: {
+            uint64_t value;
+            if(!get_u64(value)) return false;
+            obj = new Integer((long)value);
+            break;
+          }
+          case TYPE_CONS: {
+            uint32_t car, cdr;
+            if(!get_u32(car) || !get_u32(cdr) || car >= count || cdr >= count) return false;
+            obj = new Cons(nullptr, nullptr);
+            links.push_back(std::make_pair(car, cdr));
+            break;
+          }
+          case TYPE_NIL: obj = new Nil(); break;
+          case TYPE_T:   obj = new T(); break;
+          default:
+            return false;
+        }
+        if((int)lineno >= 0) set_location(obj, Location((int)lineno, (int)colno));
+        objects.push_back(obj);
+      }
+
+      size_t link = 0;
+      for(auto obj : objects) {
+        if(obj->type != TYPE_CONS) continue;
+        ((Cons*)obj)->car = objects[links[link].first];
+        ((Cons*)obj)->cdr = objects[links[link].second];
+        link++;
+      }
+
+      uint32_t form_count;
+      if(!get_u32(form_count)) return false;
+      for(uint32_t i = 0 ; i < form_count ; i++) {
+        uint32_t id;
+        if(!get_u32(id) || id >= count) return false;
+        forms.push_back(objects[id]);
+      }
+      return pos == buf.size();
+    }
+  };
+
+  bool read_cache(const std::string &path, uint64_t hash, std::vector<Object*> &forms) {
+    std::ifstream ifs(path, std::ios::binary);
+    if(ifs.fail()) return false;
+    std::string buf((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+    std::vector<Object*> cached;
+    if(!CacheReader(std::move(buf)).read(hash, cached)) return false;
+    forms.swap(cached);
+    return true;
+  }
+
+  bool write_cache(const std::string &path, uint64_t hash, const std::vector<Object*> &forms) {
+    return CacheWriter().write(path, hash, forms);
+  }
+}
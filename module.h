@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Lisp {
+  class Object;
+
+  // the path of name.lisp in the first directory of the search path that has
+  // it, or "" if none does. the search path is the current directory followed
+  // by the colon-separated directories in LISP_PATH.
+  std::string find_module(const std::string &name);
+
+  uint64_t content_hash(const std::string &code);
+
+  // where the cached forms of the module at source_path are kept
+  std::string cache_path(const std::string &source_path);
+
+  // a cache file holds the parsed top-level forms of a module, unexpanded.
+  // it is only valid for the source with the same content hash, written by an
+  // interpreter with the same type tags; read_cache returns false otherwise.
+  bool read_cache(const std::string &path, uint64_t hash, std::vector<Object*> &forms);
+  bool write_cache(const std::string &path, uint64_t hash, const std::vector<Object*> &forms);
+}
@@ -1,10 +1,94 @@
 #include "object.h"
 #include "environment.h"
+#include "memo.h"
 
-#include <typeinfo>
+#include <vector>
 
 namespace Lisp {
-  std::string String::lisp_str() { return '"' + value + '"'; }
+  // locations[0] is the missing location; the slots of destroyed objects are
+  // reused, so the table is as big as the most parsed objects alive at once
+  static std::vector<Location> locations(1);
+  static std::vector<unsigned int> free_locations;
+
+  void set_location(Object *obj, Location loc) {
+    if(!obj->location) {
+      if(free_locations.empty()) {
+        obj->location = locations.size();
+        locations.push_back(loc);
+        return;
+      }
+      obj->location = free_locations.back();
+      free_locations.pop_back();
+    }
+    locations[obj->location] = loc;
+  }
+
+  Location location_of(Object *obj) {
+    return locations[obj->location];
+  }
+
+  Object::~Object() {
+    if(location) free_locations.push_back(location);
+  }
+
+  std::string Object::lisp_str() {
+    switch(type) {
+      case TYPE_STRING:      return ((String*)this)->lisp_str();
+      case TYPE_INTEGER:     return ((Integer*)this)->lisp_str();
+      case TYPE_SYMBOL:      return ((Symbol*)this)->lisp_str();
+      case TYPE_NIL:         return ((Nil*)this)->lisp_str();
+      case TYPE_T:           return ((T*)this)->lisp_str();
+      case TYPE_CONS:        return ((Cons*)this)->lisp_str();
+      case TYPE_LAMBDA:      return ((Lambda*)this)->lisp_str();
+      case TYPE_MACRO:       return ((Macro*)this)->lisp_str();
+      case TYPE_PROMISE:     return ((Promise*)this)->lisp_str();
+      case TYPE_LINE_READER: return ((LineReader*)this)->lisp_str();
+      case TYPE_MEMO:        return ((Memo*)this)->lisp_str();
+      default:               return std::string("#<") + type_name(type) + ">";
+    }
+  }
+
+  void Object::lisp_write(std::ostream &os) {
+    switch(type) {
+      case TYPE_STRING: ((String*)this)->lisp_write(os); break;
+      case TYPE_CONS:   ((Cons*)this)->lisp_write(os); break;
+      default:          os << lisp_str(); break;
+    }
+  }
+
+  std::string String::lisp_str() { return '"' + str() + '"'; }
+
+  void String::lisp_write(std::ostream &os) {
+    os << '"';
+    os.write(data(), len);
+    os << '"';
+  }
+
+  String* String::substring(size_t start, size_t end) {
+    return new String(buf, offset + start, end - start, literal);
+  }
+
+  String* String::append(String **others, size_t count) {
+    size_t total = len;
+    for(size_t i = 0 ; i < count ; i++) total += others[i]->len;
+
+    // extend the shared buffer in place when nothing has been appended after us yet
+    std::shared_ptr<std::string> dst = buf;
+    if(literal || offset + len != buf->size()) {
+      dst = std::make_shared<std::string>();
+      dst->reserve(total);
+      dst->append(data(), len);
+    }
+    size_t start = dst == buf ? offset : 0;
+
+    for(size_t i = 0 ; i < count ; i++) {
+      // others[i] may share dst, so copy out before dst reallocates
+      if(others[i]->buf == dst) dst->append(others[i]->str());
+      else dst->append(others[i]->data(), others[i]->len);
+    }
+
+    return new String(dst, start, total);
+  }
 
   std::string Integer::lisp_str() { return std::to_string(value); }
 
@@ -14,19 +98,24 @@ namespace Lisp {
 
   std::string T::lisp_str() { return "T"; }
 
-  void Cons::mark() {
-    Object::mark();
-    car->mark(); cdr->mark();
+  void Cons::mark_children(Marker &marker) {
+    marker.mark(car); marker.mark(cdr);
   }
 
   std::string Cons::lisp_str() {
-    return lisp_str_child(true);
+    std::stringstream ss;
+    lisp_write_child(ss, true);
+    return ss.str();
+  }
+
+  void Cons::lisp_write(std::ostream &os) {
+    lisp_write_child(os, true);
   }
 
   Object* Cons::get(size_t index) {
     if(index == 0) return car;
     else {
-      if(typeid(*cdr) == typeid(Cons)) {
+      if(cdr->type == TYPE_CONS) {
         return ((Cons*)cdr)->get(index - 1);
       }
       else {
@@ -38,7 +127,7 @@ namespace Lisp {
 
   int Cons::find(Object *item) {
     int index = 0;
-    for(Cons* cc = this ; typeid(*cc) != typeid(Nil) ; cc = (Cons*)cc->cdr) {
+    for(Cons* cc = this ; cc->type != TYPE_NIL ; cc = (Cons*)cc->cdr) {
       if(cc->car->lisp_str() == item->lisp_str()) return index;
       index++;
     }
@@ -50,29 +139,26 @@ namespace Lisp {
     else return (Cons*)tail(index - 1)->cdr;
   }
 
-  std::string Cons::lisp_str_child(bool show_bracket) {
-    std::stringstream ss;
-
-    if(show_bracket) ss << '(';
+  void Cons::lisp_write_child(std::ostream &os, bool show_bracket) {
+    if(show_bracket) os << '(';
 
-    if(typeid(*car) == typeid(Cons)) {
-      ss << ((Cons*)car)->lisp_str_child(true);
+    if(car->type == TYPE_CONS) {
+      ((Cons*)car)->lisp_write_child(os, true);
     }
     else {
-      ss << car->lisp_str();
+      car->lisp_write(os);
     }
 
-    if(typeid(*cdr) == typeid(Cons)) {
-      ss << " " << ((Cons*)cdr)->lisp_str_child(false);
+    if(cdr->type == TYPE_CONS) {
+      os << " ";
+      ((Cons*)cdr)->lisp_write_child(os, false);
     }
-    else if(typeid(*cdr) != typeid(Nil)){
-      ss << " . "; // ドット対
-      ss << cdr->lisp_str();
+    else if(cdr->type != TYPE_NIL){
+      os << " . "; // ドット対
+      cdr->lisp_write(os);
     }
 
-    if(show_bracket) ss << ')';
-
-    return ss.str();
+    if(show_bracket) os << ')';
   }
 
   std::string Lambda::lisp_str() {
@@ -81,38 +167,36 @@ namespace Lisp {
     return ss.str();
   }
 
-  void Lambda::mark() {
-    GCObject::mark();
-
-    args->mark();
-    body->mark();
-    if(lexical_parent) lexical_parent->mark();
+  void Lambda::mark_children(Marker &marker) {
+    marker.mark(args);
+    marker.mark(body);
+    if(lexical_parent) marker.mark(lexical_parent);
   }
 
   Object* Macro::expand_rec(Cons* src_args, Object* cur_body) {
-    const std::type_info& typei = typeid(*cur_body);
-    if(typei == typeid(Symbol)) {
-      auto name = (Symbol*)cur_body;
-      auto index  = args->find(name);
-      return index != -1 ? src_args->get(index) : name;
-    }
-    else if(typei == typeid(Cons)) {
-      auto cons = (Cons*)cur_body;
-      return new Cons(expand_rec(src_args, cons->car), expand_rec(src_args, cons->cdr));
+    switch(cur_body->type) {
+      case TYPE_SYMBOL: {
+        auto name = (Symbol*)cur_body;
+        auto index  = args->find(name);
+        return index != -1 ? src_args->get(index) : name;
+      }
+      case TYPE_CONS: {
+        auto cons = (Cons*)cur_body;
+        return new Cons(expand_rec(src_args, cons->car), expand_rec(src_args, cons->cdr));
+      }
+      default:
+        //TODO: 他の型にも対応
+        return cur_body;
     }
-    //TODO: 他の型にも対応
-    return cur_body;
   }
 
   Object* Macro::expand(Cons* src_args) {
     return expand_rec(src_args, body);
   }
 
-  void Macro::mark() {
-    GCObject::mark();
-
-    args->mark();
-    body->mark();
+  void Macro::mark_children(Marker &marker) {
+    marker.mark(args);
+    marker.mark(body);
   }
 
   std::string Macro::lisp_str() {
@@ -120,4 +204,28 @@ namespace Lisp {
     ss << "(macro " << args->lisp_str() << " " << body->lisp_str() << ")";
     return ss.str();
   }
+
+  void Promise::resolve(Object *avalue) {
+    value = avalue;
+    // the value is all a forced promise needs; let go of the rest for gc
+    expr = nullptr;
+    env  = nullptr;
+  }
+
+  void Promise::mark_children(Marker &marker) {
+    if(expr)  marker.mark(expr);
+    if(value) marker.mark(value);
+    if(env)   marker.mark(env);
+  }
+
+  std::string Promise::lisp_str() { return "#<promise>"; }
+
+  LineReader::LineReader(std::string apath)
+    : Object(TYPE), path(apath), ifs(apath) {}
+
+  bool LineReader::read_line(std::string &line) {
+    return (bool)std::getline(ifs, line);
+  }
+
+  std::string LineReader::lisp_str() { return "#<lines \"" + path + "\">"; }
 }
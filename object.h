@@ -6,109 +6,222 @@
 #include <string>
 #include <cstdlib>
 #include <sstream>
+#include <fstream>
+#include <memory>
 
 namespace Lisp {
   class Environment;
+  class Object;
 
+  // only objects made by the parser have a source location, so an Object keeps
+  // just an index into a table of them (0 for none), in what would otherwise be
+  // padding after the GCObject header
+  void set_location(Object *obj, Location loc);
+  Location location_of(Object *obj);
+
+  // every subclass defines lisp_str() and a TYPE constant, and may define
+  // lisp_write() and mark_children(); the ones here dispatch on type to them
   class Object : public GCObject {
+    friend void set_location(Object *obj, Location loc);
+    friend Location location_of(Object *obj);
+
+    unsigned int location;
+
   public:
-    Location loc;
+    explicit Object(ObjectType atype) : GCObject(atype), location(0) {}
+    ~Object();
 
-    Object() {}
-    Object(Location aloc) : loc(aloc) {}
+    std::string lisp_str();
 
-    virtual std::string lisp_str() = 0;
+    // writes lisp_str() to os; String and Cons stream it without building it
+    void lisp_write(std::ostream &os);
   };
 
+  // A view of [offset, offset + length) in a buffer shared with other Strings.
+  // substring shares the parent's buffer, and appending to a String that ends at
+  // the end of its buffer extends the buffer in place (like a string builder),
+  // so repeated (string-append acc x) is amortized linear. The buffers of
+  // literals and their substrings are never extended; the parser shares one
+  // literal between its occurrences, and it would keep what was appended alive.
   class String : public Object {
   public:
-    std::string value;
+    static const ObjectType TYPE = TYPE_STRING;
+
+  private:
+    std::shared_ptr<std::string> buf;
+    size_t offset, len;
+
+  public:
+    // set on strings read from source; see above
+    bool literal;
+
+    String(std::string avalue)
+      : Object(TYPE), buf(std::make_shared<std::string>(std::move(avalue))), offset(0), len(buf->size()), literal(false) {}
+    String(std::shared_ptr<std::string> abuf, size_t aoffset, size_t alength, bool aliteral = false)
+      : Object(TYPE), buf(abuf), offset(aoffset), len(alength), literal(aliteral) {}
+
+    size_t length() { return len; }
+    const char* data() { return buf->data() + offset; }
+    std::string str() { return buf->substr(offset, len); }
 
-    String(std::string &avalue, Location aloc = Location()) : Object(aloc), value(avalue) {}
+    String* substring(size_t start, size_t end);
+    String* append(String **others, size_t count);
 
     std::string lisp_str();
+    void lisp_write(std::ostream &os);
   };
 
   class Integer : public Object {
   public:
+    static const ObjectType TYPE = TYPE_INTEGER;
+
     long value;
 
-    Integer(std::string &avalue, Location aloc = Location())  : Object(aloc), value(std::atol(avalue.c_str())) {}
-    Integer(long avalue, Location aloc = Location()) : Object(aloc), value(avalue) {}
+    Integer(std::string &avalue) : Object(TYPE), value(std::atol(avalue.c_str())) {}
+    Integer(long avalue) : Object(TYPE), value(avalue) {}
 
     std::string lisp_str();
   };
 
   class Symbol : public Object {
   public:
+    static const ObjectType TYPE = TYPE_SYMBOL;
+
     std::string value;
 
-    Symbol(std::string avalue, Location aloc = Location()) : Object(aloc), value(avalue) {}
+    Symbol(std::string avalue) : Object(TYPE), value(avalue) {}
 
     std::string lisp_str();
   };
 
+  // a variable captured by closures. the frame that binds it and every
+  // closure over it hold the same box, so an assignment anywhere is seen by
+  // all of them. Environment::get and set look through it; lisp code never
+  // sees one.
+  class Box : public Object {
+  public:
+    static const ObjectType TYPE = TYPE_BOX;
+
+    Object *value;
+
+    Box(Object *avalue) : Object(TYPE), value(avalue) {}
+  };
+
   // TODO: RubyみたくObject*に埋め込みたい
   class Nil : public Object {
   public:
-    Nil(Location aloc = Location()) : Object(aloc) {}
+    static const ObjectType TYPE = TYPE_NIL;
+
+    Nil() : Object(TYPE) {}
 
     std::string lisp_str();
   };
 
   class T : public Object {
   public:
-    T(Location aloc = Location()) : Object(aloc) {}
+    static const ObjectType TYPE = TYPE_T;
+
+    T() : Object(TYPE) {}
 
     std::string lisp_str();
   };
 
   class Cons : public Object {
   public:
+    static const ObjectType TYPE = TYPE_CONS;
+
     Object *car, *cdr;
 
-    Cons(Object* acar, Object* acdr, Location aloc = Location())
-     : Object(aloc), car(acar), cdr(acdr) {}
+    Cons(Object* acar, Object* acdr)
+     : Object(TYPE), car(acar), cdr(acdr) {}
 
-    void mark();
+    void mark_children(Marker &marker);
 
     std::string lisp_str();
+    void lisp_write(std::ostream &os);
 
     Object* get(size_t index);
     int find(Object *item);
     Cons* tail(size_t index);
 
   private:
-    std::string lisp_str_child(bool show_bracket);
+    void lisp_write_child(std::ostream &os, bool show_bracket);
   };
 
   class Lambda : public Object {
   public:
+    static const ObjectType TYPE = TYPE_LAMBDA;
+
     Cons *args, *body;
+    // a flat environment with the enclosing bindings body refers to, over the
+    // global environment (or the late bindings of the frame it was made in, if
+    // body refers to names not bound yet); without such bindings, that outer
+    // environment itself. see Evaluator::capture
     Environment *lexical_parent;
 
-    Lambda(Cons *aargs, Cons *abody, Environment* alexical_parent, Location aloc = Location())
-      : Object(aloc), args(aargs), body(abody), lexical_parent(alexical_parent) {}
+    Lambda(Cons *aargs, Cons *abody, Environment* alexical_parent)
+      : Object(TYPE), args(aargs), body(abody), lexical_parent(alexical_parent) {}
 
     std::string lisp_str();
 
-    void mark();
+    void mark_children(Marker &marker);
   };
 
   class Macro : public Object {
+  public:
+    static const ObjectType TYPE = TYPE_MACRO;
+
+  private:
     Cons *args, *body;
 
     Object* expand_rec(Cons* src_args, Object* cur_body);
 
   public:
-    Macro(Cons *aargs, Cons *abody, Location aloc = Location())
-     : Object(aloc), args(aargs), body(abody) {}
+    Macro(Cons *aargs, Cons *abody)
+     : Object(TYPE), args(aargs), body(abody) {}
 
     Object* expand(Cons* src_args);
 
-    void mark();
+    void mark_children(Marker &marker);
 
     std::string lisp_str();
  };
 
+  // (delay expr): expr is evaluated in env, a flat environment like Lambda's,
+  // on the first force and the result is cached
+  class Promise : public Object {
+  public:
+    static const ObjectType TYPE = TYPE_PROMISE;
+
+    Object *expr, *value;
+    Environment *env;
+
+    Promise(Object *aexpr, Environment *aenv)
+      : Object(TYPE), expr(aexpr), value(nullptr), env(aenv) {}
+
+    bool forced() { return value != nullptr; }
+    void resolve(Object *avalue);
+
+    void mark_children(Marker &marker);
+
+    std::string lisp_str();
+  };
+
+  // buffered reader behind (open-lines path)
+  class LineReader : public Object {
+  public:
+    static const ObjectType TYPE = TYPE_LINE_READER;
+
+  private:
+    std::string path;
+    std::ifstream ifs;
+
+  public:
+    LineReader(std::string apath);
+
+    bool is_open() { return ifs.is_open(); }
+    bool read_line(std::string &line);
+
+    std::string lisp_str();
+  };
 }
@@ -0,0 +1,160 @@
+#include "server.h"
+
+#include <iostream>
+#include <vector>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+namespace Lisp {
+  static const uint32_t MAX_FRAME_SIZE = 64 * 1024 * 1024;
+
+  static volatile sig_atomic_t stop_requested = 0;
+
+  static void on_stop_signal(int) {
+    stop_requested = 1;
+  }
+
+  static bool read_all(int fd, char *buf, size_t size) {
+    while(size > 0) {
+      auto n = read(fd, buf, size);
+      if(n < 0 && errno == EINTR) continue;
+      if(n <= 0) return false;
+      buf += n; size -= n;
+    }
+    return true;
+  }
+
+  static bool write_all(int fd, const char *buf, size_t size) {
+    while(size > 0) {
+      auto n = write(fd, buf, size);
+      if(n < 0 && errno == EINTR) continue;
+      if(n <= 0) return false;
+      buf += n; size -= n;
+    }
+    return true;
+  }
+
+  bool read_frame(int fd, std::string &payload) {
+    unsigned char header[4];
+    if(!read_all(fd, (char*)header, sizeof(header))) return false;
+
+    uint32_t size = (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16 |
+                    (uint32_t)header[2] << 8  | (uint32_t)header[3];
+    if(size > MAX_FRAME_SIZE) return false;
+
+    payload.resize(size);
+    return read_all(fd, &payload[0], size);
+  }
+
+  bool write_frame(int fd, const std::string &payload) {
+    if(payload.size() > MAX_FRAME_SIZE) return false;
+
+    uint32_t size = payload.size();
+    unsigned char header[4] = {
+      (unsigned char)(size >> 24), (unsigned char)(size >> 16),
+      (unsigned char)(size >> 8),  (unsigned char)size
+    };
+    return write_all(fd, (const char*)header, sizeof(header)) &&
+           write_all(fd, payload.data(), payload.size());
+  }
+
+  static sockaddr_un socket_address(const std::string &path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(addr.sun_path)) {
+      throw std::logic_error("socket path is too long: " + path);
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+    return addr;
+  }
+
+  static void run_worker(int listen_fd, RequestHandler &handler) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    while(true) {
+      int fd = accept(listen_fd, nullptr, nullptr);
+      if(fd < 0) {
+        if(errno == EINTR) continue;
+        _exit(1);
+      }
+
+      // a connection may carry any number of requests
+      std::string req;
+      while(read_frame(fd, req)) {
+        if(!write_frame(fd, handler(req))) break;
+      }
+      close(fd);
+    }
+  }
+
+  static pid_t spawn_worker(int listen_fd, RequestHandler &handler) {
+    std::cout.flush();
+    pid_t pid = fork();
+    if(pid < 0) throw std::runtime_error(std::string("fork: ") + std::strerror(errno));
+    if(pid == 0) run_worker(listen_fd, handler);
+    return pid;
+  }
+
+  void serve(const std::string &path, size_t workers, RequestHandler handler) {
+    auto addr = socket_address(path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0) throw std::runtime_error(std::string("socket: ") + std::strerror(errno));
+
+    unlink(path.c_str());
+    if(bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 128) < 0) {
+      throw std::runtime_error("can't listen on " + path + ": " + std::strerror(errno));
+    }
+
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    std::vector<pid_t> pids;
+    for(size_t i = 0 ; i < workers ; i++) {
+      pids.push_back(spawn_worker(listen_fd, handler));
+    }
+
+    // restart workers that die (e.g. on a request that crashes the interpreter)
+    while(!stop_requested) {
+      int status;
+      pid_t pid = wait(&status);
+      if(pid < 0) continue;
+      for(auto &p : pids) {
+        if(p == pid) p = spawn_worker(listen_fd, handler);
+      }
+    }
+
+    for(auto pid : pids) kill(pid, SIGTERM);
+    for(size_t i = 0 ; i < pids.size() ; i++) wait(nullptr);
+
+    close(listen_fd);
+    unlink(path.c_str());
+    std::exit(0);
+  }
+
+  bool request(const std::string &path, const std::string &payload, std::string &response) {
+    auto addr = socket_address(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) return false;
+
+    bool ok = connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0 &&
+              write_frame(fd, payload) && read_frame(fd, response);
+    close(fd);
+    return ok;
+  }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+#include <functional>
+
+namespace Lisp {
+  typedef std::function<std::string(const std::string&)> RequestHandler;
+
+  // a frame is a 4-byte big-endian length followed by that many bytes
+  bool read_frame(int fd, std::string &payload);
+  bool write_frame(int fd, const std::string &payload);
+
+  // listens on the unix socket at path and answers each request frame with
+  // handler's result. workers are forked after the caller has warmed up its
+  // state, so every worker starts from a copy of it and clients are served
+  // concurrently. does not return.
+  void serve(const std::string &path, size_t workers, RequestHandler handler);
+
+  // sends payload as one request and stores the reply in response
+  bool request(const std::string &path, const std::string &payload, std::string &response);
+}
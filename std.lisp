@@ -3,3 +3,5 @@
 (print "loaded std module")
 
 (defmacro defun (name args body) (setq name (lambda args body)))
+
+(defmacro defun-memo (name args body) (setq name (memoize (lambda args body))))
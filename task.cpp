@@ -0,0 +1,88 @@
+#include "task.h"
+#include "environment.h"
+
+#include <stdexcept>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace Lisp {
+  // as deep as the main stack usually is: an evaluation step takes several
+  // native frames. only the pages a task touches are committed.
+  static const size_t TASK_STACK_SIZE = 8 * 1024 * 1024;
+  static const size_t MAX_POOLED_STACKS = 64;
+
+  static std::vector<char*> stack_pool;
+
+  static char* new_stack() {
+    if(!stack_pool.empty()) {
+      auto stack = stack_pool.back();
+      stack_pool.pop_back();
+      return stack;
+    }
+
+    void *mem = mmap(nullptr, TASK_STACK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(mem == MAP_FAILED) throw std::runtime_error("can't allocate a task stack");
+    // the lowest page is a guard, so an overflow faults instead of running into other memory
+    mprotect(mem, sysconf(_SC_PAGESIZE), PROT_NONE);
+    return (char*)mem;
+  }
+
+  void clear_stack_pool() {
+    for(auto stack : stack_pool) munmap(stack, TASK_STACK_SIZE);
+    stack_pool.clear();
+  }
+
+  Task::Task(Lambda *afunc, std::vector<Object*> aargs)
+    : Object(TYPE), func(afunc), args(aargs), state(RUNNABLE), waiting_on(nullptr), deadlocked(false),
+      result(nullptr), failed(false), env(nullptr), base(nullptr), stack(nullptr),
+      suspended_at(nullptr), stack_top(nullptr) {}
+
+  Task::~Task() {
+    release_stack();
+  }
+
+  void Task::prepare(void (*entry)()) {
+    stack = new_stack();
+    getcontext(&context);
+    context.uc_stack.ss_sp   = stack;
+    context.uc_stack.ss_size = TASK_STACK_SIZE;
+    context.uc_link = nullptr;
+    makecontext(&context, entry, 0);
+    stack_top = stack + TASK_STACK_SIZE;
+  }
+
+  void Task::use_thread_stack() {
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+    if(pthread_getattr_np(pthread_self(), &attr) != 0) throw std::runtime_error("can't find the thread's stack");
+    pthread_attr_getstack(&attr, &addr, &size);
+    pthread_attr_destroy(&attr);
+    stack_top = (char*)addr + size;
+  }
+
+  void Task::release_stack() {
+    if(!stack) return;
+    if(stack_pool.size() < MAX_POOLED_STACKS) stack_pool.push_back(stack);
+    else munmap(stack, TASK_STACK_SIZE);
+    stack = nullptr;
+  }
+
+  void Task::mark_children(Marker &marker) {
+    marker.mark(func);
+    for(auto arg : args) marker.mark(arg);
+    marker.mark(waiting_on);
+    marker.mark(result);
+    marker.mark(env);
+    marker.mark(base);
+    for(auto root : roots) marker.mark(root);
+    for(auto form : forms) marker.mark(form);
+  }
+
+  void Channel::mark_children(Marker &marker) {
+    for(auto item : items) marker.mark(item);
+  }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "object.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <ucontext.h>
+
+namespace Lisp {
+  // (spawn f args...): a green thread calling f with args. tasks are
+  // multiplexed on one OS thread by the Evaluator; each has its own native
+  // stack and evaluation state, which are saved here while it is switched out.
+  // the main program runs as a task without a stack of its own.
+  class Task : public Object {
+  public:
+    static const ObjectType TYPE = TYPE_TASK;
+
+    enum State { RUNNABLE, WAITING, DONE };
+
+    Lambda *func;
+    std::vector<Object*> args;
+
+    State state;
+    Object *waiting_on;  // the task or channel it waits for
+    bool deadlocked;     // woken because nothing else could wake it
+
+    Object *result;
+    bool failed;
+    std::string error;
+
+    // the evaluator state of the task while it isn't running
+    Environment *env, *base;
+    std::vector<Object*> roots;
+    std::vector<Cons*> forms;
+
+    ucontext_t context;
+    char *stack;
+    // the native stack in use while the task is switched out: from where it
+    // was suspended up to the top, where it starts (it grows down). the gc
+    // scans it for objects the task's native frames hold
+    const char *suspended_at, *stack_top;
+
+    Task(Lambda *afunc, std::vector<Object*> aargs);
+    ~Task();
+
+    // gives the task a stack that starts at entry
+    void prepare(void (*entry)());
+    // the task runs on the calling thread's own stack (the main program)
+    void use_thread_stack();
+    // returns the stack to the pool; the task must not be running on it
+    void release_stack();
+
+    void mark_children(Marker &marker);
+  };
+
+  // (make-channel [capacity]): a queue of values between tasks. a send waits
+  // while more than capacity sent values haven't been received, so with the
+  // default capacity 0 it waits for a receiver to take its value.
+  class Channel : public Object {
+  public:
+    static const ObjectType TYPE = TYPE_CHANNEL;
+
+    std::deque<Object*> items;
+    size_t capacity;
+    size_t sent, received;
+
+    Channel(size_t acapacity) : Object(TYPE), capacity(acapacity), sent(0), received(0) {}
+
+    void mark_children(Marker &marker);
+  };
+
+  void clear_stack_pool();
+}
@@ -0,0 +1,21 @@
+(setq n 10)
+(defun f () n)
+(defun g (n) (f))
+(print (g 5))
+(defun make-adder (x) (lambda (y) (+ x y)))
+(setq add-three (make-adder 3))
+(defun h (x) (add-three x))
+(print (h 4))
+(defun counter (c) (lambda () (setq c (+ c 1))))
+(setq next (counter 0))
+(next)
+(print (next))
+(defun f (k) (cond ((setq loop (lambda (n) (cond ((= n 0) 0) (t (loop (- n 1)))))) (loop k))))
+(print (f 3))
+(defun later () (cond ((setq get-x (lambda () x)) (cond ((setq x 5) (get-x))))))
+(print (later))
+(defun make-late () (cond ((setq get-y (lambda () y)) (cond ((setq y 7) get-y)))))
+(setq late-y (make-late))
+(print (late-y))
+(setq in-let (lambda () (setq get-w nil) (let ((z 1)) (setq get-w (lambda () w))) (setq w 9) (get-w)))
+(print (in-let))
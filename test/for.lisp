@@ -0,0 +1,5 @@
+(setq i 100)
+(for i 0 3 (print i))
+(print i)
+(setq count (lambda (i) (for i 0 2 (print i)) i))
+(print (count 7))
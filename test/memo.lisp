@@ -0,0 +1,27 @@
+; with capacity 2 the least recently used entry is evicted; misses print x
+(setq sq (memoize (lambda (x) (cond ((print x) nil) (t (* x x)))) 2))
+(print (sq 1))
+(print (sq 2))
+(print (sq 1))
+(print (sq 3))
+(print (sq 1))
+(print (sq 2))
+(print (sq 3))
+
+; entries for lambdas nothing else refers to are dropped by gc. their values
+; were marked through the entries, so they go in the collection after
+(setq seen (memoize (lambda (f) (atom f))))
+(setq fill (lambda (n) (cond ((= n 0) nil) (t (cond ((seen (lambda (x) x)) (fill (- n 1))))))))
+(gc)
+(setq before (number-of-objects))
+(fill 200)
+(gc)
+(gc)
+(print (> (+ before 20) (number-of-objects)))
+
+; hash-consed lists that are structurally equal are the same object
+(print (eq (hash-cons 1 (hash-cons 2 nil)) (hash-cons 1 (hash-cons 2 nil))))
+(print (eq (cons 1 (cons 2 nil)) (cons 1 (cons 2 nil))))
+(setq keep (hash-cons "a" nil))
+(gc)
+(print (eq keep (hash-cons "a" nil)))
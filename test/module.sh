@@ -0,0 +1,35 @@
+# modules found through LISP_PATH, required from inside a function, and their caches
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+export LISP_PATH="$dir"
+
+check() {
+  if [ "$2" != "$3" ]; then
+    echo "$1: expected '$2', got '$3'"
+    exit 1
+  fi
+}
+
+printf '(defun sq (x) (* x x))\n(setq greeting "hello")\n(gc)\n' > "$dir/m.lisp"
+
+# the bindings of a module required in a function are global, and the
+# function's locals survive the module's (gc)
+out=$(printf '(defun f (a) (cond ((require "m") a) (t a)))\n(print (f (cons 1 2)))\n(print (sq 3))\n' | ./lisp | tail -n +2)
+check "require in a function" "$(printf '(1 . 2)\n9')" "$out"
+[ -f "$dir/m.lispc" ] || { echo "no cache written"; exit 1; }
+
+# a cache with the same source is used
+perl -pi -e 's/hello/jello/' "$dir/m.lispc"
+out=$(echo '(require "m")(print greeting)' | ./lisp | tail -n +2)
+check "cached forms" '"jello"' "$out"
+
+# a cache whose type names differ from the interpreter's is not
+perl -pi -e 's/Symbol/Symbox/' "$dir/m.lispc"
+out=$(echo '(require "m")(print greeting)' | ./lisp | tail -n +2)
+check "cache with other type tags" '"hello"' "$out"
+
+# nor is one of an older source
+perl -pi -e 's/hello/jello/' "$dir/m.lispc"
+printf '(setq greeting "changed")\n' > "$dir/m.lisp"
+out=$(echo '(require "m")(print greeting)' | ./lisp | tail -n +2)
+check "edited source" '"changed"' "$out"
@@ -0,0 +1,24 @@
+# a heap marked by several threads keeps the same objects as one marked by one
+check() {
+  if [ "$2" != "$3" ]; then
+    echo "$1: expected '$2', got '$3'"
+    exit 1
+  fi
+}
+
+src='(setq keep nil)
+(for i 0 3000 (setq keep (cons (cons i i) keep)))
+(for i 0 3000 (cons i i))
+(gc)
+(print (number-of-objects))
+(setq keep nil)
+(gc)
+(print (number-of-objects))'
+
+serial=$(echo "$src" | LISP_GC_THREADS=1 ./lisp | tail -n +2)
+parallel=$(echo "$src" | LISP_GC_THREADS=4 LISP_GC_PARALLEL_THRESHOLD=0 ./lisp | tail -n +2)
+check "objects after parallel marking" "$serial" "$parallel"
+
+# the 3000 kept pairs, their conses and their integers survive the first gc
+kept=$(echo "$parallel" | head -n 1)
+[ "$kept" -ge 9000 ] || { echo "kept list collected: $kept objects"; exit 1; }
@@ -0,0 +1,26 @@
+#!/bin/sh
+# runs each test/NAME.lisp and compares its output with test/NAME.out, and
+# runs each test/NAME.sh, which passes by exiting with 0
+cd "$(dirname "$0")/.." || exit 1
+
+failed=0
+for src in test/*.lisp; do
+  expected="${src%.lisp}.out"
+  if ./lisp < "$src" 2>&1 | diff -u "$expected" - > /dev/null; then
+    echo "ok   $src"
+  else
+    echo "FAIL $src"
+    ./lisp < "$src" 2>&1 | diff -u "$expected" -
+    failed=1
+  fi
+done
+for script in test/*.sh; do
+  [ "$script" = test/run.sh ] && continue
+  if sh "$script"; then
+    echo "ok   $script"
+  else
+    echo "FAIL $script"
+    failed=1
+  fi
+done
+exit $failed
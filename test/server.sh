@@ -0,0 +1,14 @@
+# a request that sets globals mustn't affect the requests after it
+sock="${TMPDIR:-/tmp}/lisp-test-$$.sock"
+./lisp --serve "$sock" --workers 1 > /dev/null &
+server=$!
+trap 'kill $server 2> /dev/null' EXIT
+
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  [ -S "$sock" ] && break
+  sleep 0.1
+done
+
+echo '(setq defun 1)(setq x 1)(defun f (y) y)' | ./lisp --client "$sock" > /dev/null
+reply=$(echo '(defun g (y) (+ y 1))(print (g 1))' | ./lisp --client "$sock")
+[ "$reply" = "2" ] || { echo "expected 2, got: $reply"; exit 1; }
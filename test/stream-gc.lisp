@@ -0,0 +1,8 @@
+(defun ints (n) (cons-stream n (ints (+ n 1))))
+(setq sq (lambda (x) (gc) (cons x (cons (* x x) nil))))
+(print (stream-take (stream-map sq (ints 1)) 4))
+(setq even (lambda (x) (gc) (= (mod x 2) 0)))
+(print (stream-take (stream-filter even (ints 1)) 3))
+(defun gc-ints (n) (cons-stream n (cond ((gc) nil) (t (gc-ints (+ n 1))))))
+(print (stream-take (gc-ints 1) 3))
+(print (force (delay (cons (gc) 1))))
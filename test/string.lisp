@@ -0,0 +1,26 @@
+(print (string-append))
+(print (string-append "a"))
+(print (string-append "a" "b" "c"))
+(print (string-length (string-append)))
+(print (substring "hello" 1 3))
+(print (substring "hello" 2))
+(print (substring "hello" 5))
+(print (string-length "hello"))
+(print (string-length (substring "hello" 1 4)))
+(print (string->symbol (string-append "fo" "o")))
+(print (number->string 42))
+(print (number->string (- 0 7)))
+(setq base (string-append "ab" "c"))
+(setq x (string-append base "x"))
+(setq y (string-append base "y"))
+(print x)
+(print y)
+(print (string-append x "1"))
+(print (string-append y "2"))
+(print x)
+(print y)
+(print base)
+(setq lit "lit")
+(print (string-append lit "eral"))
+(print (string-append lit "!"))
+(print lit)
@@ -0,0 +1,21 @@
+(defun churn (n) (cond ((for i 0 n (cons i (cons i i))) 1) (t 1)))
+
+; collecting while the producer is unfinished keeps the heap small
+(setq ch (make-channel))
+(defun producer (n) (for i 0 n (send ch (+ i (churn 1000)))))
+(setq p (spawn producer 10))
+(setq sum 0)
+(for i 0 10 (setq sum (+ sum (receive ch))) (gc))
+(print (> 3000 (number-of-objects)))
+(print sum)
+(join p)
+
+; tasks preempted in the middle of an expression keep its partial results
+(defun work (k) (for j 0 40 (+ (churn 50) (* 2 (+ (churn 30) j)) (string-length (number->string j)))))
+(defun collector (n) (for i 0 n (gc) (yield)))
+(setq a (spawn work 1))
+(setq b (spawn collector 200))
+(defun sumsq (n) (cond ((= n 0) 0) (t (+ (* n n) (churn 5) (sumsq (- n 1))))))
+(print (sumsq 200))
+(join a)
+(join b)
@@ -24,9 +24,9 @@ namespace Lisp {
     Location loc;
 
     Token(TokenType atype, Location aloc)
-     : type(atype), value(std::string()), loc(aloc) {}
+     : GCObject(TYPE_TOKEN), type(atype), value(std::string()), loc(aloc) {}
     Token(TokenType atype, std::string avalue, Location aloc)
-     : type(atype), value(avalue), loc(aloc) {}
+     : GCObject(TYPE_TOKEN), type(atype), value(avalue), loc(aloc) {}
 
     std::string str();
   };